@@ -3,28 +3,125 @@
 #include "../common.h"
 #include "node.h"
 #include "lookup_fn.h"
+#include "../utils/reed_solomon.h"
+#include <condition_variable>
 
 class Client : public Node {
 public:
   Client(uint16_t port = 0) : Node("Client", port) {
     SocketNode::silent = true;
+    storageStats = vector<StorageStats>(nStorages);  // from the config, as the topology will be. never resized after
     requestTopo();
   }
-//  unordered_map<K, Locations> dynamicCache;  // the return from storage node should include the
-//
-//  inline void UpdateCache(const K &k, Locations locations) {
-//    dynamicCache.insert(make_pair(k, locations));
-//  }
+  
+  // bounded LRU of K -> Locations, filled from Locate and Insert replies. the masters push an Update
+  // <locations, k> to subscribed clients whenever they move or remove k, which refreshes or drops the entry
+  uint locationCacheSize = 1 << 16;  // entries. 0 disables the cache (and the subscription)
+  mutex cacheLock;
+  list<pair<K, Locations>> cacheLru;  // front is the most recently used
+  unordered_map<K, list<pair<K, Locations>>::iterator> locationCache;
+  
+  bool cachedLocations(const K &k, Locations &out) {
+    lock_guard<mutex> g(cacheLock);
+    auto it = locationCache.find(k);
+    if (it == locationCache.end()) return false;
+    
+    cacheLru.splice(cacheLru.begin(), cacheLru, it->second);
+    out = it->second->second;
+    return true;
+  }
+  
+  void cacheLocations(const K &k, const Locations &locations) {
+    if (!locationCacheSize || locations.locs[0].dId == uint32_t(-1)) return;
+    
+    lock_guard<mutex> g(cacheLock);
+    auto it = locationCache.find(k);
+    if (it != locationCache.end()) {
+      it->second->second = locations;
+      cacheLru.splice(cacheLru.begin(), cacheLru, it->second);
+      return;
+    }
+    
+    cacheLru.emplace_front(k, locations);
+    locationCache[k] = cacheLru.begin();
+    if (cacheLru.size() > locationCacheSize) {
+      locationCache.erase(cacheLru.back().first);
+      cacheLru.pop_back();
+    }
+  }
+  
+  // only keys already cached are refreshed: a push must not fill the cache with keys this client never used
+  void onLocationsPushed(const K &k, const Locations &locations) {
+    lock_guard<mutex> g(cacheLock);
+    if (k.empty()) {  // the master fell behind on the pushes, so none of the entries can be trusted
+      locationCache.clear();
+      cacheLru.clear();
+      return;
+    }
+    auto it = locationCache.find(k);
+    if (it == locationCache.end()) return;
+    
+    if (locations.locs[0].dId == uint32_t(-1)) {  // removed
+      cacheLru.erase(it->second);
+      locationCache.erase(it);
+    } else {
+      it->second->second = locations;
+    }
+  }
+  
+  // shards whose Ludo DP this client replicates. locations of their keys are resolved locally, and reads go straight
+  // to the storage, without the lookup hop. the master streams the same updates as to its lookups. empty: none
+  inline static vector<uint> replicaShards;
+  unordered_map<uint, LudoReplica> replicas;  // shard -> replica. filled before subscribing, fixed afterwards
+  mutex replicaLock;
+  unordered_map<int, uint> replicaStreams;  // fd of a master's update stream -> shard
+  
+  int replicaStream(int fd) {
+    lock_guard<mutex> g(replicaLock);
+    auto it = replicaStreams.find(fd);
+    return it == replicaStreams.end() ? -1 : it->second;
+  }
+  
+  // false if k's shard is not replicated here (or the snapshot has not arrived), or k is not found
+  bool replicaLocations(const K &k, Locations &out) {
+    auto it = replicas.find(getShard(k));
+    if (it == replicas.end() || !it->second.synced) return false;
+    
+    out = it->second.locate(k);
+    return out.locs[0].dId != uint32_t(-1);
+  }
+  
+  void startRoutine() override {
+    Node::startRoutine();
+    
+    replicas.reserve(replicaShards.size());
+    
+    for (uint shard: replicaShards) {
+      if (replicas.count(shard)) continue;  // the topology may be pulled again
+      replicas[shard].init(shardCapacity(), shard * 0xe2211);
+      my_write(masters[shard].addrPort, SubscribeLudo, &port, 2);
+    }
+    
+    if (!locationCacheSize) return;
+    for (auto &m: masters) {
+      my_write(m.addrPort, Subscribe, &port, 2);
+    }
+  }
   
   bool onMessage(int msgType, int id, const int fd, const string &ip, vector<char> &msg) override {
     if (Node::onMessage(msgType, 0, fd, ip, msg)) return true;
     
-    if (msgType == MessageTypes::Update) {
+    int shard;
+    if (msgType == SubscribeLudo) {  // first frame of a master's update stream
+      lock_guard<mutex> g(replicaLock);
+      replicaStreams[fd] = *(uint32_t *) msg.data();
+    } else if (msgType < ReadReply && (shard = replicaStream(fd)) >= 0) {
+      replicas[shard].apply(msgType, msg);
+    } else if (msgType == MessageTypes::Update) {
       K k = msg.data() + sizeof(Locations);
-//      UpdateCache(k, *(Locations *) msg.data());
+      onLocationsPushed(k, *(Locations *) msg.data());
     } else if (msgType >= ReadReply) {  // all other msg types are for read reply
-      mylock_guard g(commitBufLock);
-      commitBuffer[msgType] = msg;
+      onReadReply(msgType, id, msg);
     } else return false;
     
     return true;
@@ -38,139 +135,866 @@ public:
     }
   }
   
-  recursive_mutex commitBufLock;
-  unordered_map <uint32_t, vector<char>> commitBuffer;
+  // many of these can be in flight on the one connection to a lookup node. the reply is a Locations
+  future<vector<char>> LocateAsync(const K &k) {
+    Locations locations;
+    if (replicaLocations(k, locations)) {
+      promise<vector<char>> p;
+      p.set_value(vector<char>((char *) &locations, (char *) &locations + sizeof(Locations)));
+      return p.get_future();
+    }
+    
+    return call(lookups[getAnyLookupNode(k)].addrPort, MessageTypes::Locate, k);
+  }
   
-  vector<char> Read(const K &k) {
-    vector<char> result;
-
-//// log("Start reading key: " + k);
-
-    while (result.size() != blockSize) {  // master/lookup may be not fully constructed
-      if (result.size()) this_thread::sleep_for(1s);
-
-      uint lId = getAnyLookupNode(k);
-
-      uint32_t seq = 0;
-      while (seq < 100) seq = rand();
-
-      vector<char> msg(k.length() + 8 + 1);
+  // reads use triangle communication: the lookup forwards to storage, and the object (or the range of it) arrives as
+  // a new frame whose type is the read's seq. a pending read completes in onMessage the moment that frame arrives
+  uint readTimeoutMs = 200;   // per attempt, before the read is sent again
+  uint readBackoffMs = 100;   // before retrying after a failed reply (master/lookup may be not fully constructed)
+  uint readAttempts = 10;     // then the read completes with an empty block
+  
+  // replica choice for reads whose locations are known here (Ludo replica, or location cache): with balancedReads,
+  // the replica with the lowest latency * in-flight reads is read instead of the main one. with hedging, a read not
+  // answered within the hedgePercentile-th latency of recent reads is sent again to another replica, and the first
+  // block to arrive wins. reads going through a lookup are hedged via it. either may see the old block during an update
+  bool balancedReads = false;
+  uint hedgePercentile = 0;  // e.g., 95. 0 disables hedging
+  uint hedgeMinUs = 1000;    // lower bound of the hedge delay
+  
+  struct StorageStats {
+    atomic<uint> inflight{0};
+    atomic<uint32_t> latencyUs{0};  // moving average. 0: not read yet
+  };
+  vector<StorageStats> storageStats;  // [storage #]. read without a lock, so sized once in the constructor
+  
+  mutex latencyLock;
+  vector<uint32_t> latencies;  // a ring of recent read latencies
+  uint latencyCount = 0;
+  atomic<uint32_t> hedgeDelayUs{0};  // 0: too few samples yet
+  
+  struct PendingRead {
+    K k;
+    uint attempts;
+    chrono::steady_clock::time_point deadline;
+    function<void(vector<char> &&)> callback;
+    uint32_t offset = 0, length = uint32_t(-1);  // the byte range. -1: to the end of the object
+    
+    bool located = false;  // then sent to storage nodes directly
+    Locations locations;
+    uint tried = 0;  // bitmask of replicas sent to
+    vector<uint32_t> sentTo;  // storages with this read counted as in flight
+    chrono::steady_clock::time_point sentAt, hedgeAt;
+    bool fragment = false;  // of a stripe: read from locations.locs[0] only, and not retried
+    
+    PendingRead(const K &k, uint attempts, function<void(vector<char> &&)> callback, uint32_t offset, uint32_t length)
+        : k(k), attempts(attempts), callback(move(callback)), offset(offset), length(length) {}
+  };
+  
+  mutex readLock;
+  condition_variable readCv;
+  unordered_map<uint32_t, PendingRead> pendingReads;  // seq -> read
+  atomic<uint32_t> nextSeq{0};
+  bool readTimerStarted = false;
+  
+  // the object, or length bytes of it from offset. empty if the read failed
+  void ReadAsync(const K &k, uint32_t offset, uint32_t length, function<void(vector<char> &&)> callback) {
+    PendingRead read(k, 0, move(callback), offset, length);
+    sendRead(move(read));
+  }
+  
+  void ReadAsync(const K &k, function<void(vector<char> &&)> callback) {
+    ReadAsync(k, 0, uint32_t(-1), move(callback));
+  }
+  
+  future<vector<char>> ReadAsync(const K &k, uint32_t offset = 0, uint32_t length = uint32_t(-1)) {
+    auto p = make_shared<promise<vector<char>>>();
+    future<vector<char>> f = p->get_future();
+    ReadAsync(k, offset, length, [p](vector<char> &&block) { p->set_value(move(block)); });
+    return f;
+  }
+  
+  vector<char> Read(const K &k, uint32_t offset = 0, uint32_t length = uint32_t(-1)) {
+    return ReadAsync(k, offset, length).get();
+  }
+  
+  // the replica to read among those not tried: the first in order, or the least loaded. -1 if none is left.
+  // one read in 32 goes to a random one, so a storage that was slow once gets measured again
+  int pickReplica(const Locations &locations, uint tried) {
+    int best = -1;
+    uint64_t bestScore = -1;
+    bool probe = rand() % 32 == 0;
+    for (uint r = 0; r < nReplicas; ++r) {
+      uint32_t dId = locations.locs[r].dId;
+      if (dId == uint32_t(-1) || (tried >> r & 1)) continue;
+      if (!balancedReads) return r;
+      
+      uint64_t score = probe ? rand() : uint64_t(storageStats[dId].latencyUs + 1) * (storageStats[dId].inflight + 1);
+      if (score < bestScore) {
+        bestScore = score;
+        best = r;
+      }
+    }
+    return best;
+  }
+  
+  // to replica r directly, in the format of the lookup's forward. ":port" tells the storage to reply to our ip
+  string directRead(uint32_t seq, PendingRead &read, uint r, vector<char> &msg) {
+    Location loc = read.locations.locs[r];
+    read.tried |= 1 << r;
+    read.sentTo.push_back(loc.dId);
+    storageStats[loc.dId].inflight++;
+    
+    string clientAddr = ":" + to_string(port);
+    msg.resize(20 + clientAddr.size() + 1);
+    uint32_t *p = (uint32_t *) msg.data();
+    p[0] = seq;
+    p[1] = loc.blkId;
+    p[2] = loc.offset;
+    p[3] = read.offset;
+    p[4] = read.length;
+    memcpy(msg.data() + 20, clientAddr.data(), clientAddr.size() + 1);
+    return storages[loc.dId].addrPort;
+  }
+  
+  // replica: 0 lets the lookup choose, r + 1 asks for locs[r]
+  string lookupRead(uint32_t seq, const PendingRead &read, uint replica, vector<char> &msg) {
+    msg.resize(read.k.length() + 16 + 1);
+    uint32_t *p = (uint32_t *) msg.data();
+    p[0] = seq;
+    p[1] = port | replica << 16;
+    p[2] = read.offset;
+    p[3] = read.length;
+    memcpy(msg.data() + 16, read.k.data(), read.k.length() + 1);
+    return lookups[getAnyLookupNode(read.k)].addrPort;
+  }
+  
+  void settle(PendingRead &read) {
+    for (uint32_t dId: read.sentTo) storageStats[dId].inflight--;
+    read.sentTo.clear();
+  }
+  
+  void sendRead(PendingRead &&read) {
+    uint32_t seq = 100 + nextSeq++ % (RpcTag - 100);  // seqs double as frame types, so they stay in [100, 2^31)
+    
+    read.attempts++;
+    read.tried = 0;
+    if (!read.fragment) {
+      read.located = replicaLocations(read.k, read.locations) ||
+                     ((balancedReads || hedgePercentile) && cachedLocations(read.k, read.locations));
+      if (read.located && read.locations.locs[0].striped()) return readStripe(move(read));
+    }
+    
+    auto now = chrono::steady_clock::now();
+    uint32_t delay = hedgeDelayUs;
+    read.sentAt = now;
+    read.deadline = now + chrono::milliseconds(readTimeoutMs);
+    read.hedgeAt = hedgePercentile && delay ? now + chrono::microseconds(delay) : chrono::steady_clock::time_point::max();
+    
+    string addrPort;
+    vector<char> msg;
+    int r;
+    if (read.located && (r = pickReplica(read.locations, 0)) >= 0) {
+      addrPort = directRead(seq, read, r, msg);
+    } else if (read.fragment) {  // the fragment has no location
+      return read.callback({});
+    } else {
+      read.located = false;
+      read.tried = 1;  // the lookup's choice, usually the main replica
+      addrPort = lookupRead(seq, read, 0, msg);
+    }
+    
+    bool fragment = read.fragment;
+    {
+      lock_guard<mutex> g(readLock);
+      pendingReads.emplace(seq, move(read));
+      startReadTimer();
+    }
+    readCv.notify_one();
+    
+    if (!fragment) {
+      my_write(addrPort, MessageTypes::Read, msg);
+      return;
+    }
+    
+    // the storage of a fragment may be down. then the fragment fails at once, and the stripe is rebuilt without it
+    int fd = acquireConnection(addrPort, false, true);
+    if (fd >= 0 && my_write(fd, MessageTypes::Read, msg) >= 0) {
+      releaseConnection(addrPort, fd, true);
+      return;
+    }
+    if (fd >= 0) close(fd);
+    
+    unique_lock<mutex> g(readLock);
+    auto it = pendingReads.find(seq);
+    if (it == pendingReads.end()) return;
+    PendingRead failed = move(it->second);
+    pendingReads.erase(it);
+    settle(failed);
+    g.unlock();
+    failed.callback({});
+  }
+  
+  // the duplicate of a slow read, under the same seq
+  void hedge(uint32_t seq) {
+    string addrPort;
+    vector<char> msg;
+    {
+      lock_guard<mutex> g(readLock);
+      auto it = pendingReads.find(seq);
+      if (it == pendingReads.end()) return;
+      
+      PendingRead &read = it->second;
+      read.hedgeAt = chrono::steady_clock::time_point::max();
+      if (read.located) {
+        int r = pickReplica(read.locations, read.tried);
+        if (r < 0) return;
+        addrPort = directRead(seq, read, r, msg);
+      } else {
+        uint r = 1;
+        while (r < nReplicas && (read.tried >> r & 1)) r++;
+        if (r >= nReplicas) return;
+        read.tried |= 1 << r;
+        addrPort = lookupRead(seq, read, r + 1, msg);
+      }
+    }
+    
+    my_write(addrPort, MessageTypes::Read, msg);
+  }
+  
+  // single: the read went to one replica only, so the latency is that storage's (id)
+  void recordLatency(int id, uint32_t us, bool single) {
+    if (single && id >= 0 && size_t(id) < storageStats.size()) {
+      uint32_t old = storageStats[id].latencyUs;
+      storageStats[id].latencyUs = old ? (old * 7 + us) / 8 : us;
+    }
+    if (!hedgePercentile) return;
+    
+    lock_guard<mutex> g(latencyLock);
+    if (latencies.size() < 256) latencies.push_back(us);
+    else latencies[latencyCount % 256] = us;
+    
+    if (++latencyCount % 32 == 0) {
+      vector<uint32_t> sorted = latencies;
+      auto nth = sorted.begin() + min<size_t>(sorted.size() - 1, sorted.size() * hedgePercentile / 100);
+      nth_element(sorted.begin(), nth, sorted.end());
+      hedgeDelayUs = max(hedgeMinUs, *nth);
+    }
+  }
+  
+  void onReadReply(uint32_t seq, int id, vector<char> &msg) {
+    if (onMultiReadReply(seq, msg)) return;
+    
+    unique_lock<mutex> g(readLock);
+    auto it = pendingReads.find(seq);  // late replies of retried, hedged or finished reads are dropped
+    if (it == pendingReads.end()) return;
+    
+    PendingRead &read = it->second;
+    bool ok = !msg.empty() && msg.back() == 1;
+    if (msg.size() == 1 && msg[0] == 2) {  // erasure-coded: read as a stripe
+      PendingRead striped = move(read);
+      pendingReads.erase(it);
+      settle(striped);
+      g.unlock();
+      return locateStripe(move(striped));
+    }
+    if (!ok && read.attempts < readAttempts) {
+      read.deadline = chrono::steady_clock::now() + chrono::milliseconds(readBackoffMs);
+      read.hedgeAt = chrono::steady_clock::time_point::max();
+      readCv.notify_one();
+      return;
+    }
+    
+    PendingRead done = move(read);
+    pendingReads.erase(it);
+    settle(done);
+    g.unlock();
+    
+    if (ok) {
+      msg.pop_back();  // the status byte
+      auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - done.sentAt).count();
+      recordLatency(id, us, __builtin_popcount(done.tried) == 1);
+    } else {
+      msg.clear();
+    }
+    done.callback(move(msg));
+  }
+  
+  // erasure coding for the objects this client inserts, e.g., those of a cold tenant: the master places a stripe of
+  // ecData data fragments and ecParity parity ones instead of the replicas, and each fragment is written to its
+  // storage directly, all in parallel. a read fetches the part of the range in each data fragment, and rebuilds the
+  // fragments that do not arrive from the others
+  bool erasureCoded = false;
+  ReedSolomon codec{ecData, ecParity};
+  
+  // the lookup answered a read with the status of a stripe. its locations are needed to read the fragments
+  void locateStripe(PendingRead &&read) {
+    future<vector<char>> located = LocateAsync(read.k);
+    thread([this, read = move(read), located = move(located)]() mutable {
+      vector<char> v = located.get();
+      if (v.size() == sizeof(Locations) && ((Locations *) v.data())->locs[0].striped()) {
+        read.locations = *(Locations *) v.data();
+        cacheLocations(read.k, read.locations);
+        readStripe(move(read));
+      } else if (read.attempts < readAttempts) {  // rewritten in the meantime
+        sendRead(move(read));
+      } else {
+        read.callback({});
+      }
+    }).detach();
+  }
+  
+  void readStripe(PendingRead &&read) {
+    uint32_t size = read.locations.locs[0].stripedSize(), F = fragmentSize(size);
+    uint32_t begin = min(read.offset, size), end = size - begin < read.length ? size : begin + read.length;
+    
+    vector<array<uint32_t, 3>> parts;  // (fragment, from, length)
+    for (uint32_t i = 0; i < ecData; ++i) {
+      uint32_t from = max(begin, i * F), to = min(end, (i + 1) * F);
+      if (from < to) parts.push_back({i, from - i * F, to - from});
+    }
+    if (parts.empty()) return read.callback({});
+    
+    auto pending = make_shared<PendingRead>(move(read));
+    readFragments(*pending, parts, [this, pending, parts, begin, end](vector<vector<char>> &&fragments) {
+      vector<char> object;
+      object.reserve(end - begin);
+      for (uint j = 0; j < parts.size(); ++j) {
+        if (fragments[j].size() != parts[j][2]) return readDegraded(move(*pending), begin, end);
+        object.insert(object.end(), fragments[j].begin(), fragments[j].end());
+      }
+      pending->callback(move(object));
+    });
+  }
+  
+  // all the fragments in full, and the missing data ones rebuilt from them
+  void readDegraded(PendingRead &&read, uint32_t begin, uint32_t end) {
+    uint32_t size = read.locations.locs[0].stripedSize(), F = fragmentSize(size);
+    vector<array<uint32_t, 3>> parts;
+    for (uint32_t r = 0; r < ecData + ecParity; ++r) parts.push_back({r, 0, uint32_t(-1)});
+    
+    auto pending = make_shared<PendingRead>(move(read));
+    readFragments(*pending, parts, [this, pending, size, F, begin, end](vector<vector<char>> &&fragments) {
+      bool present[ecData + ecParity];
+      uint8_t *shards[ecData + ecParity];
+      for (uint32_t r = 0; r < ecData + ecParity; ++r) {
+        uint32_t length = r < ecData ? min(size, (r + 1) * F) - min(size, r * F) : F;
+        present[r] = fragments[r].size() == length;
+        fragments[r].resize(F);  // a short one padded with zeros, as when encoded
+        shards[r] = (uint8_t *) fragments[r].data();
+      }
+      if (!codec.reconstruct(shards, present, F)) return pending->callback({});
+      
+      vector<char> object(end - begin);
+      for (uint32_t at = begin; at < end;) {
+        uint32_t i = at / F, n = min(end, (i + 1) * F) - at;
+        memcpy(object.data() + at - begin, fragments[i].data() + at - i * F, n);
+        at += n;
+      }
+      pending->callback(move(object));
+    });
+  }
+  
+  // parts of fragments, read at once. each is empty in done if it failed
+  void readFragments(const PendingRead &read, const vector<array<uint32_t, 3>> &parts,
+                     function<void(vector<vector<char>> &&)> done) {
+    auto job = make_shared<MultiReadJob>();
+    job->blocks.resize(parts.size());
+    job->remaining = parts.size();
+    job->callback = move(done);
+    
+    for (uint j = 0; j < parts.size(); ++j) {
+      PendingRead fragment(read.k, readAttempts - 1, [job, j](vector<char> &&block) { job->done(j, move(block)); },
+                           parts[j][1], parts[j][2]);
+      const Location &location = read.locations.locs[parts[j][0]];
+      fragment.fragment = true;
+      fragment.located = true;
+      fragment.locations.locs[0] = {location.dId, location.blkId, 0};  // untagged: the fragment itself
+      sendRead(move(fragment));
+    }
+  }
+  
+  // resends reads that timed out or wait for a retry, fails those out of attempts, and hedges slow ones
+  void startReadTimer() {
+    if (readTimerStarted) return;
+    readTimerStarted = true;
+    
+    thread([this]() {
+      prctl(PR_SET_NAME, "Client read timer", 0, 0, 0);
+      
+      unique_lock<mutex> g(readLock);
+      while (alive) {
+        auto now = chrono::steady_clock::now();
+        auto next = now + 1s;
+        vector<PendingRead> expired;
+        vector<PendingBatch> expiredBatches;
+        vector<uint32_t> hedges;
+        
+        for (auto it = pendingReads.begin(); it != pendingReads.end();) {
+          if (it->second.deadline <= now) {
+            settle(it->second);
+            expired.push_back(move(it->second));
+            it = pendingReads.erase(it);
+          } else {
+            if (it->second.hedgeAt <= now) hedges.push_back(it->first);
+            else next = min(next, it->second.hedgeAt);
+            next = min(next, it->second.deadline);
+            ++it;
+          }
+        }
+        for (auto it = pendingBatches.begin(); it != pendingBatches.end();) {
+          if (it->second.deadline <= now) {
+            expiredBatches.push_back(move(it->second));
+            it = pendingBatches.erase(it);
+          } else {
+            next = min(next, it->second.deadline);
+            ++it;
+          }
+        }
+        
+        if (expired.empty() && expiredBatches.empty() && hedges.empty()) {
+          readCv.wait_until(g, next);
+          continue;
+        }
+        
+        g.unlock();
+        for (uint32_t seq: hedges) {
+          hedge(seq);
+        }
+        for (PendingRead &read: expired) {
+          if (read.attempts < readAttempts) sendRead(move(read));
+          else read.callback({});
+        }
+        for (PendingBatch &batch: expiredBatches) {
+          for (uint i = 0; i < batch.keys.size(); ++i) {
+            if (!batch.arrived[i]) readSingly(batch.job, batch.keys[i], batch.slots[i]);
+          }
+        }
+        g.lock();
+      }
+    }).detach();
+  }
+  
+  // locations of many keys: one MultiLocate per shard, all in flight together. replicated shards resolve locally
+  vector<Locations> MultiLocate(const vector<K> &keys) {
+    vector<Locations> out(keys.size());
+    unordered_map<uint, vector<uint>> byShard;  // shard -> indexes of its keys
+    for (uint i = 0; i < keys.size(); ++i) {
+      byShard[getShard(keys[i])].push_back(i);
+    }
+    
+    vector<pair<vector<uint> *, future<vector<char>>>> calls;
+    for (auto &pair: byShard) {
+      vector<K> shardKeys;
+      shardKeys.reserve(pair.second.size());
+      for (uint i: pair.second) shardKeys.push_back(keys[i]);
+      
+      auto it = replicas.find(pair.first);
+      if (it != replicas.end() && it->second.synced) {
+        vector<Locations> locations = it->second.locate(shardKeys);
+        for (uint j = 0; j < locations.size(); ++j) out[pair.second[j]] = locations[j];
+        continue;
+      }
+      
+      vector<char> msg;
+      appendKeys(msg, shardKeys);
+      calls.emplace_back(&pair.second, call(lookups[getAnyLookupNode(shardKeys[0])].addrPort, MessageTypes::MultiLocate,
+                                            msg.data(), msg.size()));
+    }
+    
+    for (auto &c: calls) {
+      vector<char> v = c.second.get();
+      if (v.size() != c.first->size() * sizeof(Locations)) continue;  // the lookup is gone. left as not found
+      
+      Locations *p = (Locations *) v.data();
+      for (uint j = 0; j < c.first->size(); ++j) out[(*c.first)[j]] = p[j];
+    }
+    return out;
+  }
+  
+  // MultiRead: the keys of a shard go to one lookup in frames of up to multiReadBatch keys. the lookup resolves a frame
+  // under one lock and sends each storage node one request for all its blocks there, answered in one frame.
+  // keys not found, and those of a frame that times out, fall back to single reads with their retries
+  uint multiReadBatch = 128;  // keys per frame. a reply carries up to this many blocks, and frame lengths are 32-bit
+  uint multiReadTimeoutMs = 2000;
+  
+  struct MultiReadJob {
+    vector<vector<char>> blocks;
+    atomic<uint> remaining;
+    function<void(vector<vector<char>> &&)> callback;
+    
+    void done(uint slot, vector<char> &&block) {
+      blocks[slot] = move(block);
+      if (--remaining == 0) callback(move(blocks));
+    }
+  };
+  
+  struct PendingBatch {
+    shared_ptr<MultiReadJob> job;
+    vector<K> keys;
+    vector<uint> slots;  // of each key in the job
+    vector<bool> arrived;
+    uint left;
+    chrono::steady_clock::time_point deadline;
+  };
+  
+  unordered_map<uint32_t, PendingBatch> pendingBatches;  // seq -> frame of a MultiRead. guarded by readLock
+  
+  void MultiReadAsync(const vector<K> &keys, function<void(vector<vector<char>> &&)> callback) {
+    if (keys.empty()) return callback({});
+    
+    auto job = make_shared<MultiReadJob>();
+    job->blocks.resize(keys.size());
+    job->remaining = keys.size();
+    job->callback = move(callback);
+    
+    unordered_map<uint, PendingBatch> byShard;
+    for (uint i = 0; i < keys.size(); ++i) {
+      PendingBatch &batch = byShard[getShard(keys[i])];
+      batch.keys.push_back(keys[i]);
+      batch.slots.push_back(i);
+      if (batch.keys.size() == multiReadBatch) {
+        batch.job = job;
+        sendMultiRead(move(batch));
+        batch = PendingBatch();
+      }
+    }
+    
+    for (auto &pair: byShard) {
+      if (pair.second.keys.empty()) continue;
+      pair.second.job = job;
+      sendMultiRead(move(pair.second));
+    }
+  }
+  
+  future<vector<vector<char>>> MultiReadAsync(const vector<K> &keys) {
+    auto p = make_shared<promise<vector<vector<char>>>>();
+    future<vector<vector<char>>> f = p->get_future();
+    MultiReadAsync(keys, [p](vector<vector<char>> &&blocks) { p->set_value(move(blocks)); });
+    return f;
+  }
+  
+  vector<vector<char>> MultiRead(const vector<K> &keys) {
+    return MultiReadAsync(keys).get();
+  }
+  
+  void readSingly(const shared_ptr<MultiReadJob> &job, const K &k, uint slot) {
+    ReadAsync(k, [job, slot](vector<char> &&block) { job->done(slot, move(block)); });
+  }
+  
+  void sendMultiRead(PendingBatch &&batch) {
+    uint32_t seq = 100 + nextSeq++ % (RpcTag - 100);
+    uint shard = getShard(batch.keys[0]);
+    batch.arrived.assign(batch.keys.size(), false);
+    batch.left = batch.keys.size();
+    batch.deadline = chrono::steady_clock::now() + chrono::milliseconds(multiReadTimeoutMs);
+    
+    unordered_map<uint32_t, vector<char>> perStorage;
+    string lookupAddr;
+    vector<char> msg;
+    auto it = replicas.find(shard);
+    if (it != replicas.end() && it->second.synced) {  // straight to the storage nodes, as a lookup would
+      vector<uint32_t> misses = groupMultiRead(seq, ":" + to_string(port), it->second.locate(batch.keys), perStorage);
+      for (uint32_t i: misses) {
+        batch.arrived[i] = true;
+        batch.left--;
+        readSingly(batch.job, batch.keys[i], batch.slots[i]);
+      }
+      if (!batch.left) return;
+    } else {
+      msg.resize(8);
       uint32_t *p = (uint32_t *) msg.data();
       p[0] = seq;
       p[1] = port;
-      memcpy(msg.data() + 8, k.data(), k.length() + 1);
-
-      my_write(lookups[lId].addrPort, MessageTypes::Read, msg);
-
-      for (int count = 0; count <
-                          5; ++count) {  // use triangle communication, so the answer is not available via the current duplex TCP channel.
-        this_thread::sleep_for(20ms);
-
-        mylock_guard g(commitBufLock);
-        const auto &it = commitBuffer.find(seq);  // to avoid possible reorders, use a mapping to buffer
-        if (it != commitBuffer.end()) {           // and each function instance polls the buffer
-          result = it->second;
-          commitBuffer.erase(it);
-          break;
-        }
-      }
+      appendKeys(msg, batch.keys);
+      lookupAddr = lookups[getAnyLookupNode(batch.keys[0])].addrPort;
+    }
+    
+    {
+      lock_guard<mutex> g(readLock);
+      pendingBatches.emplace(seq, move(batch));
+      startReadTimer();
+    }
+    readCv.notify_one();
+    
+    if (!lookupAddr.empty()) my_write(lookupAddr, MessageTypes::MultiRead, msg);
+    for (auto &pair: perStorage) {
+      my_write(storages[pair.first].addrPort, MessageTypes::MultiRead, pair.second);
     }
-
-//// log("End reading key: " + k);
-    return result;
   }
   
-  void Insert(const K &k, void *data) { // size is fixed 4MB
+  bool onMultiReadReply(uint32_t seq, vector<char> &msg) {
+    unique_lock<mutex> g(readLock);
+    auto it = pendingBatches.find(seq);
+    if (it == pendingBatches.end()) return false;
+    
+    PendingBatch &batch = it->second;
+    shared_ptr<MultiReadJob> job = batch.job;
+    if (msg.size() < 4) return true;
+    
+    uint32_t n = *(uint32_t *) msg.data();
+    vector<pair<uint, vector<char>>> blocks;  // slot, object
+    vector<pair<K, uint>> misses;
+    const char *entry = msg.data() + 4, *end = msg.data() + msg.size();
+    for (uint32_t i = 0; i < n && entry + 8 <= end; ++i) {
+      uint32_t index = *(uint32_t *) entry, length = *(uint32_t *) (entry + 4);
+      uint32_t skip = length == uint32_t(-1) ? 0 : length;
+      if (entry + 8 + skip > end) break;
+      
+      const char *object = entry + 8;
+      entry = object + skip;
+      if (index >= batch.keys.size() || batch.arrived[index]) continue;
+      
+      batch.arrived[index] = true;
+      batch.left--;
+      if (length != uint32_t(-1)) blocks.emplace_back(batch.slots[index], vector<char>(object, object + length));
+      else misses.emplace_back(batch.keys[index], batch.slots[index]);
+    }
+    if (!batch.left) pendingBatches.erase(it);
+    g.unlock();
+    
+    for (auto &b: blocks) job->done(b.first, move(b.second));
+    for (auto &m: misses) readSingly(job, m.first, m.second);
+    return true;
+  }
+  
+  // false if the object could not be placed or written, as with insert, Update and MultiInsert
+  bool Insert(const K &k, void *data, uint32_t size = blockSize) { // an object of up to 4MB
+    return insert(k, data, size, erasureCoded);
+  }
+  
+  bool insert(const K &k, void *data, uint32_t size, bool striped) {
 //// log("Start inserting key: " + k);
+    assert(size <= blockSize);
     
     uint mId = getShard(k);
     uint type = MessageTypes::Insert;
-    size_t locSize = nReplicas * sizeof(Location);
-    uint length = blockSize + locSize;
     
-    int fd = connectToServer(masters[mId].addrPort);
-    my_write(fd, type, k);
-    vector<char> v = get<2>(my_read(fd));
-    close(fd);
+    // <k, size, striped>: the master packs small objects into shared blocks, and stripes erasure-coded ones
+    vector<char> request(k.length() + 1 + 5);
+    memcpy(request.data(), k.c_str(), k.length() + 1);
+    *(uint32_t *) (request.data() + k.length() + 1) = size;
+    request.back() = striped;
+    vector<char> v = call(masters[mId].addrPort, type, request.data(), request.size()).get();
+    if (v.size() != sizeof(Locations)) {
+      cerr << "Insert fail for key " << k << ", mId: " << mId << endl;
+      return false;
+    }
+    cacheLocations(k, *(Locations *) v.data());
+    if (!store((Location *) v.data(), data, size)) {
+      cerr << "Insert fail for key " << k << " at storage " << ((Location *) v.data())->dId << endl;
+      return false;
+    }
+
+//// log("End inserting key: " + k);
+    return true;
+  }
+  
+  // MultiInsert: the keys of a shard go to their master in frames of up to multiInsertBatch keys, all sent before any
+  // reply is awaited. the master allocates a frame under one lock, with one log commit and one update to the lookups
+  uint multiInsertBatch = 1024;
+  
+  bool MultiInsert(const vector<K> &keys, const vector<void *> &data, const vector<uint32_t> &sizes) {
+    unordered_map<uint, vector<uint>> byShard;  // shard -> indexes of its keys
+    for (uint i = 0; i < keys.size(); ++i) byShard[getShard(keys[i])].push_back(i);
     
-    Location *locs = (Location *) v.data();
+    vector<pair<vector<uint>, future<vector<char>>>> frames;  // indexes of the keys, locations
+    for (auto &pair: byShard) {
+      vector<uint> &indexes = pair.second;
+      for (uint from = 0; from < indexes.size(); from += multiInsertBatch) {
+        vector<uint> frame(indexes.begin() + from, indexes.begin() + min<size_t>(from + multiInsertBatch, indexes.size()));
+        
+        // <n, (k, size, striped) * n>
+        vector<char> request(4);
+        *(uint32_t *) request.data() = frame.size();
+        for (uint i: frame) {
+          const K &k = keys[i];
+          size_t off = request.size();
+          request.resize(off + k.length() + 1 + 5);
+          memcpy(request.data() + off, k.c_str(), k.length() + 1);
+          *(uint32_t *) (request.data() + off + k.length() + 1) = sizes[i];
+          request.back() = erasureCoded;
+        }
+        
+        frames.emplace_back(move(frame), call(masters[pair.first].addrPort, MessageTypes::MultiInsert, request.data(),
+                                              request.size()));
+      }
+    }
     
-    fd = connectToServer(storages[locs[0].dId].addrPort);
-    raw_write(fd, &type, 4);   // for efficiency
-    raw_write(fd, &thisId, 4);
+    bool ok = true;
+    for (auto &frame: frames) {
+      vector<char> v = frame.second.get();
+      if (v.size() != frame.first.size() * sizeof(Locations)) {
+        cerr << "MultiInsert fail for " << frame.first.size() << " keys from " << keys[frame.first[0]] << endl;
+        ok = false;
+        continue;
+      }
+      
+      auto *locations = (Locations *) v.data();
+      for (uint j = 0; j < frame.first.size(); ++j) {
+        uint i = frame.first[j];
+        cacheLocations(keys[i], locations[j]);
+        if (store(locations[j].locs, data[i], sizes[i])) continue;
+        cerr << "MultiInsert fail for key " << keys[i] << " at storage " << locations[j].locs[0].dId << endl;
+        ok = false;
+      }
+    }
+    return ok;
+  }
+  
+  // writes an object to the locations its master gave it. false if they are none, or a storage failed
+  bool store(Location *locs, void *data, uint32_t size) {
+    assert(size <= blockSize);
     
-    raw_write(fd, &length, 4);
-    raw_write(fd, locs, locSize);
-    raw_write(fd, data, blockSize);
+    if (locs[0].dId >= storages.size()) return false;
+    if (locs[0].striped()) return writeStripe(locs, data, size);
     
-    bool succ = get<2>(my_read(fd))[0];
-    if (!succ) debug_break();
-    close(fd);
-
-//// log("End inserting key: " + k);
+    vector<char> reply = writeReplicated(locs, data, size);
+    return !reply.empty() && reply[0];
+  }
+  
+  // through the first replica, which passes it on. the storage's reply, empty if it could not be reached
+  vector<char> writeReplicated(Location *locs, void *data, uint32_t size) {
+    string addrPort = storages[locs[0].dId].addrPort;
+    int fd = acquireConnection(addrPort, false);
+    if (fd < 0) return {};
+    
+    iovec parts[2] = {{locs, nReplicas * sizeof(Location)}, {data, size}};  // for efficiency, without copying the object
+    if (my_writev(fd, MessageTypes::Insert, parts, 2) < 0) {
+      close(fd);
+      return {};
+    }
+    
+    vector<char> reply = get<2>(my_read(fd));
+    finishExchange(addrPort, fd, reply);
+    return reply;
   }
   
-  void Update(const K &k, void *data) { // size is fixed 4MB
+  bool Update(const K &k, void *data, uint32_t size = blockSize) { // an object of up to 4MB
 //// log("Start updating key: " + k);
+    assert(size <= blockSize);
     
     uint lId = getAnyLookupNode(k);
-    size_t locSize = nReplicas * sizeof(Location);
-    uint length = blockSize + locSize;
     
     uint type = MessageTypes::Locate;
-    int fd = connectToServer(lookups[lId].addrPort);
-    my_write(fd, type, k);
-    vector<char> v = get<2>(my_read(fd));
-    close(fd);
+    vector<char> v(sizeof(Locations));
+    if (replicaLocations(k, *(Locations *) v.data())) {
+    } else if (!cachedLocations(k, *(Locations *) v.data())) {  // hot keys skip the lookup hop
+      v = call(lookups[lId].addrPort, type, k).get();
+      if (v.size() == sizeof(Locations)) cacheLocations(k, *(Locations *) v.data());
+    }
     
     Location *locs = (Location *) v.data();
     
-    if (v.empty() || locs[0].dId == uint32_t(-1)) {
+    if (v.size() != sizeof(Locations) || locs[0].dId == uint32_t(-1)) {
       cerr << "Lookup fail for key " << k << ", lId: " << lId << ". Trying to recover via master" << endl;
       uint mId = getShard(k);
       
       uint type = MessageTypes::Insert;
-      size_t locSize = nReplicas * sizeof(Location);
-      uint length = blockSize + locSize;
-      
-      int fd = connectToServer(masters[mId].addrPort);
-      my_write(fd, type, k);
-      v = get<2>(my_read(fd));
-      close(fd);
+      v = call(masters[mId].addrPort, type, k).get();
+      if (v.size() == sizeof(Locations)) cacheLocations(k, *(Locations *) v.data());
+      locs = (Location *) v.data();
       
-      if (v.empty())
+      if (v.size() != sizeof(Locations) || locs[0].dId >= storages.size()) {
         cerr << "Still fail" << endl;
+        return false;
+      }
     }
 
 //// log("Updating key: " + k + " on storage " + to_string(locs[0].dId));
-    type = MessageTypes::Insert;
-    fd = connectToServer(storages[locs[0].dId].addrPort);
-    raw_write(fd, &type, 4);   // for efficiency
-    raw_write(fd, &thisId, 4);
-    
-    raw_write(fd, &length, 4);
-    raw_write(fd, locs, locSize);
-    raw_write(fd, data, blockSize);
-    
-    bool succ = get<2>(my_read(fd))[0];
-    if (!succ) debug_break();
-    close(fd);
+    if (locs[0].striped()) {  // the stripe is laid out for its size: rewritten in place, or placed anew
+      if (locs[0].stripedSize() == size) return writeStripe(locs, data, size);
+      Remove(k);
+      return insert(k, data, size, true);
+    }
+    
+    vector<char> reply = writeReplicated(locs, data, size);
+    if (!reply.empty() && !reply[0] && locs[0].packed()) {  // outgrew its packed extent: placed anew
+      Remove(k);
+      return Insert(k, data, size);
+    }
+    if (reply.empty() || !reply[0]) {
+      cerr << "Update fail for key " << k << " at storage " << locs[0].dId << endl;
+      return false;
+    }
 
 //// log("End updating key: " + k);
+    return true;
   }
   
-  void Remove(const K &k) {
+  // one fragment to each storage of the stripe, all sent before any reply is awaited
+  bool writeStripe(const Location *locs, const void *data, uint32_t size) {
+    uint32_t F = fragmentSize(size);
+    const uint8_t *fragments[ecData + ecParity];
+    uint32_t lengths[ecData + ecParity];
+    vector<vector<uint8_t>> padded(ecData + ecParity);  // the parity ones, and the short data ones padded to F
+    const uint8_t *encoded[ecData];
+    uint8_t *parity[ecParity];
+    for (uint32_t i = 0; i < ecData + ecParity; ++i) {
+      if (i >= ecData) {
+        padded[i].resize(F);
+        fragments[i] = parity[i - ecData] = padded[i].data();
+        lengths[i] = F;
+        continue;
+      }
+      
+      uint32_t from = min(size, i * F);
+      fragments[i] = encoded[i] = (const uint8_t *) data + from;
+      lengths[i] = min(size, from + F) - from;
+      if (lengths[i] < F) {
+        padded[i].assign(F, 0);
+        memcpy(padded[i].data(), fragments[i], lengths[i]);
+        encoded[i] = padded[i].data();
+      }
+    }
+    codec.encode(encoded, parity, F);
+    
+    int fds[ecData + ecParity];
+    for (uint32_t r = 0; r < ecData + ecParity; ++r) {
+      Locations only;  // no replicas to forward to
+      only.locs[0] = locs[r];
+      fds[r] = acquireConnection(storages[locs[r].dId].addrPort, false);  // -1: the storage is down
+      iovec parts[2] = {{&only, nReplicas * sizeof(Location)}, {(void *) fragments[r], lengths[r]}};
+      if (fds[r] >= 0 && my_writev(fds[r], MessageTypes::Insert, parts, 2) < 0) {
+        close(fds[r]);
+        fds[r] = -1;
+      }
+    }
+    
+    bool ok = true;
+    for (uint32_t r = 0; r < ecData + ecParity; ++r) {
+      if (fds[r] < 0) {
+        ok = false;
+        continue;
+      }
+      vector<char> reply = get<2>(my_read(fds[r]));
+      finishExchange(storages[locs[r].dId].addrPort, fds[r], reply);
+      ok &= !reply.empty() && reply[0];
+    }
+    return ok;
+  }
+  
+  // false if the key was not there, or the master did not answer
+  bool Remove(const K &k) {
 //// log("Start removing key: " + k);
     
     uint mId = getShard(k);
     uint type = MessageTypes::Remove;
     
-    int fd = connectToServer(masters[mId].addrPort);
-    my_write(fd, type, k);
-    bool succ = get<2>(my_read(fd))[0];
-    if (!succ) debug_break();
-    close(fd);
+    // retried like a read while no reply comes. once an attempt timed out, a later one may find the key gone already
+    vector<char> reply;
+    bool timedOut = false;
+    for (uint attempt = 0; attempt < readAttempts && reply.empty(); ++attempt) {
+      if (attempt) this_thread::sleep_for(chrono::milliseconds(readBackoffMs));
+      reply = call(masters[mId].addrPort, type, k, readTimeoutMs).get();
+      timedOut |= reply.empty();
+    }
+    if (reply.empty() || (!reply[0] && !timedOut)) {
+      cerr << "Remove fail for key " << k << ", mId: " << mId << endl;
+      return false;
+    }
+    onLocationsPushed(k, Locations());
 
 //// log("End removing key: " + k);
+    return true;
   }
 };
@@ -3,6 +3,191 @@
 #include "node.h"
 #include "../Ludo/ludo_cp_dp.h"
 
+// the compact routing state of one shard: a DataPlaneLudo, plus the fallback table for keys inserted while the
+// master rebuilds. it follows the master's update stream (Insert/Remove/Update/UpdateLudo, each wrapped in Sequenced).
+// lookup nodes keep one, and so can clients that want to resolve locations without the lookup hop
+class LudoReplica {
+public:
+  DataPlaneLudo<K, Locations> *dp = nullptr, *background;
+  unordered_map <K, Locations> fallback;
+  mutable recursive_mutex updateLock;
+  atomic<bool> synced{false};  // received a full UpdateLudo. before that, only a replica started with the master is usable
+  // of the last Sequenced frame. a gap means the master dropped updates for this replica, which is then stale until
+  // the UpdateLudo that the master sends next
+  uint64_t lastSeq = 0, gaps = 0;
+  
+  void init(uint32_t cap, uint32_t seed) {
+    dp = new DataPlaneLudo<K, Locations>;
+    dp->resizeCapacity(cap);
+    dp->setSeed(seed);
+    
+    fallback.reserve(cap / 10);
+  }
+  
+  // returns false for messages that are not part of the update stream
+  bool apply(int msgType, vector<char> &msg) {
+    if (msgType == Sequenced) {
+      uint64_t seq;
+      uint32_t type;
+      memcpy(&seq, msg.data(), 8);
+      memcpy(&type, msg.data() + 8, 4);
+      if (lastSeq && seq != lastSeq + 1) {
+        gaps++;
+        synced = false;
+      }
+      lastSeq = seq;
+      
+      msg.erase(msg.begin(), msg.begin() + 12);
+      return apply(type, msg);
+    }
+    
+    if (msgType == Insert) {
+      applyInsert(msg.data(), msg.size());
+    } else if (msgType == MultiInsert) {  // <n, (length, Insert message) * n>
+      uint32_t n, length;
+      memcpy(&n, msg.data(), 4);
+      size_t off = 4;
+      for (uint32_t i = 0; i < n; ++i) {
+        memcpy(&length, msg.data() + off, 4);
+        applyInsert(msg.data() + off + 4, length);
+        off += 4 + length;
+      }
+    } else if (msgType == Remove) {
+      const string key = K(msg.data());
+      fallback.erase(key);
+    } else if (msgType == Update) {
+      char mode = msg[0];
+      Locations locations = *(Locations *) (msg.data() + 1);
+      
+      if (mode == 0) {
+        int off = 1 + sizeof(Locations);
+        uint32_t bs;
+        memcpy(&bs, msg.data() + off, 4);
+        dp->applyUpdate(bs, locations);
+      } else { // mode == 1
+        K k = msg.data() + 1 + sizeof(Locations);
+        fallback.insert(make_pair(k, *(Locations *) (msg.data() + 1)));
+      }
+    } else if (msgType == UpdateOthello) {
+      runtime_error("not implemented");
+    } else if (msgType == UpdateLudo) {
+      background = new DataPlaneLudo<K, Locations>;
+      
+      uint32_t *p = (uint32_t *) msg.data();
+      DataPlaneOthello<K, uint8_t, 1> &locator = background->locator;
+      locator.hab.s = *(uint64_t *) p;
+      int i = 2;
+      locator.hd.s = p[i++];
+      locator.ma = p[i++];
+      locator.mb = p[i++];
+      
+      uint64_t sz = (((uint64_t) locator.ma + locator.mb) * locator.VDL + 63) / 64;
+      locator.mem.resize(sz);
+      memcpy(locator.mem.data(), msg.data() + 4 * i, sz * 8);
+      
+      bool notOnlyOthello = msg[4 * i + sz * 8];
+      assert(notOnlyOthello);
+      
+      uint64_t *ps = (uint64_t * )(msg.data() + 4 * i + sz * 8 + 1);
+      background->h.s = ps[0];
+      background->digestH.s = ps[1];
+      uint32_t cnt = background->num_buckets_ = ps[2];
+      
+      auto *pb = (DataPlaneLudo<K, Locations>::Bucket *) (ps + 3);
+      background->buckets.resize(background->num_buckets_);
+      memcpy(background->buckets.data(), pb, cnt * sizeof(pb[0]));
+      
+      mylock_guard g(updateLock);
+      fallback.clear();
+      swap(dp, background);
+      synced = true;
+      delete background;
+    } else return false;
+    
+    return true;
+  }
+  
+  // no need for any lock, because only one writer and all the inconsistent data do not hurt
+  void applyInsert(const char *msg, size_t size) {
+    char mode = msg[0];
+    Locations locations = *(Locations *) (msg + 1);
+    
+    if (mode == 0) {
+      size_t off = 1 + sizeof(Locations);
+      vector <Ludo_PathEntry<K>> entries;
+      while (off < size) {
+        Ludo_PathEntry<K> entry;
+        memcpy(&entry, msg + off, 10);
+        
+        entry.locatorCC.resize(entry.status);
+        memcpy(entry.locatorCC.data(), msg + off + 10, entry.status * 4);
+        
+        entries.emplace_back(move(entry));
+        off += 10 + entry.status * 4;
+      }
+      if (off > size) debug_break();
+      
+      dp->applyInsert(entries, move(locations));
+    } else { // mode == 1
+      K k = msg + 1 + sizeof(Locations);
+      fallback.insert(make_pair(k, *(Locations *) (msg + 1)));
+    }
+  }
+  
+  inline Locations locate(const K &k) const {
+    mylock_guard g(updateLock);
+    
+    auto it = fallback.find(k);
+    if (it != fallback.end()) return it->second;
+    
+    return dp->lookUp(k);
+  }
+  
+  // a batch under one lock acquisition
+  vector<Locations> locate(const vector<K> &keys) const {
+    vector<Locations> out(keys.size());
+    mylock_guard g(updateLock);
+    
+    for (uint i = 0; i < keys.size(); ++i) {
+      auto it = fallback.find(keys[i]);
+      out[i] = it != fallback.end() ? it->second : dp->lookUp(keys[i]);
+    }
+    return out;
+  }
+};
+
+// splits a MultiRead batch by the main replica of each key: one <seq, n, (index, blkId, blkOffset) * n, clientAddr> message per
+// storage node. returns the indexes of keys not found
+inline vector<uint32_t> groupMultiRead(uint32_t seq, const string &clientAddr, const vector<Locations> &locations,
+                                       unordered_map<uint32_t, vector<char>> &perStorage) {
+  vector<uint32_t> misses;
+  for (uint32_t i = 0; i < locations.size(); ++i) {
+    Location loc = locations[i].locs[0];  // always go to main node for latest update
+    if (loc.dId == uint32_t(-1)) {
+      misses.push_back(i);
+      continue;
+    }
+    
+    vector<char> &msg = perStorage[loc.dId];
+    if (msg.empty()) msg.resize(8);
+    uint64_t off = msg.size();
+    msg.resize(off + 12);
+    uint32_t *p = (uint32_t *) (msg.data() + off);
+    p[0] = i;
+    p[1] = loc.blkId;
+    p[2] = loc.offset;
+  }
+  
+  for (auto &pair: perStorage) {
+    vector<char> &msg = pair.second;
+    uint32_t *p = (uint32_t *) msg.data();
+    p[0] = seq;
+    p[1] = (msg.size() - 8) / 12;
+    msg.insert(msg.end(), clientAddr.c_str(), clientAddr.c_str() + clientAddr.size() + 1);
+  }
+  return misses;
+}
+
 class Lookup : public Node {
 public:
   Lookup(uint16_t port = 0) : Node("Lookup", port) {}
@@ -26,25 +211,34 @@ public:
     Node::startRoutine();
     name = string("Lookup#") + to_string(thisId);
     
-    uint64_t sumCap = 0;
-    for (auto info:storages) {
-      sumCap += info.capacity;
-    }
-    
-    dp = new DataPlaneLudo<K, Locations>;
-    uint32_t cap = sumCap / nShards;
-    dp->resizeCapacity(cap);
     for (int i = 0; i < nShards && myMaster > 0; ++i) {
       for (uint id:lookupFunctionsForShard[i]) {
         if (id == thisId) myMaster = i;
       }
     }
-    dp->setSeed(myMaster * 0xe2211);
+    replica.init(shardCapacity(), myMaster * 0xe2211);
+    forwarded = vector<atomic<uint64_t>>(nStorages);
+  }
+  
+  // spread reads over the replicas, to the one this lookup sent the fewest so far, instead of always the main one
+  // ("always go to main node for latest update"). a read racing an update may then see the old block, because
+  // the chain writes the main replica first
+  inline static bool balancedReads = false;
+  vector<atomic<uint64_t>> forwarded;  // storage -> reads sent to it
+  
+  uint pickReplica(const Locations &locations) {
+    if (!balancedReads || locations.locs[0].dId == uint32_t(-1)) return 0;
     
-    fallback.reserve(cap / 10);
+    uint best = 0;
+    for (uint r = 1; r < nReplicas; ++r) {
+      uint32_t dId = locations.locs[r].dId;
+      if (dId != uint32_t(-1) && forwarded[dId] < forwarded[locations.locs[best].dId]) best = r;
+    }
+    forwarded[locations.locs[best].dId]++;
+    return best;
   }
   
-  mutable recursive_mutex updateLock;
+  LudoReplica replica;
   
   bool onMessage(int msgType, int id, const int fd, const string &ip, vector<char> &msg) override {
     try {
@@ -54,102 +248,62 @@ public:
         uint32_t *p = (uint32_t *) msg.data();
         uint32_t seq = p[0];
         uint16_t port = p[1];
+        uint replica = p[1] >> 16;  // 0: ours to choose. r: locs[r - 1], for a hedged duplicate from the client
+        uint32_t offset = p[2], length = p[3];
         string clientAddr = ip + ":" + to_string(port);
         
-        string k = msg.data() + 8;
+        string k = msg.data() + 16;
 //      Location loc = locate(k).locs[rand() % nReplicas];
-        Location loc;
-        loc = locate(k).locs[0];  // always go to main node for latest update
+        Locations locations = locate(k);
+        Location loc = locations.locs[replica && replica <= nReplicas ? replica - 1 : pickReplica(locations)];
+        if (loc.dId == uint32_t(-1)) loc = locations.locs[0];
         if (loc.dId == uint32_t(-1)) {
         // log("Error: key not found: " + k);
           my_write(clientAddr, seq, "\0");
           return true;
         }
         
-        msg.resize(8 + clientAddr.size() + 1);
+        msg.resize(20 + clientAddr.size() + 1);
         p = (uint32_t *) msg.data();
         p[0] = seq;
         p[1] = loc.blkId;
-        memcpy(msg.data() + 8, clientAddr.data(), clientAddr.size() + 1);
+        p[2] = loc.offset;
+        p[3] = offset;
+        p[4] = length;
+        memcpy(msg.data() + 20, clientAddr.data(), clientAddr.size() + 1);
         
         my_write(storages[loc.dId].addrPort, Read, msg);
       } else if (msgType == MessageTypes::Locate) {
         string k = msg.data();
         Locations locations = locate(k);
         my_write(fd, Return, &locations, sizeof(Locations));
-      } else if (msgType == Insert) {  // no need for any lock, because only one writer and all the inconsistent data do not hurt
-        char mode = msg[0];
-        Locations locations = *(Locations *) (msg.data() + 1);
-        
-        if (mode == 0) {
-          int off = 1 + sizeof(Locations);
-          vector <Ludo_PathEntry<K>> entries;
-          while (off < msg.size()) {
-            Ludo_PathEntry<K> entry;
-            memcpy(&entry, msg.data() + off, 10);
-            
-            entry.locatorCC.resize(entry.status);
-            memcpy(entry.locatorCC.data(), msg.data() + off + 10, entry.status * 4);
-            
-            entries.emplace_back(move(entry));
-            off += 10 + entry.status * 4;
-          }
-          if (off > msg.size()) debug_break();
-          
-          dp->applyInsert(entries, move(locations));
-        } else { // mode == 1
-          K k = msg.data() + 1 + sizeof(Locations);
-          fallback.insert(make_pair(k, *(Locations *) (msg.data() + 1)));
-        }
-      } else if (msgType == Remove) {
-        const string key = K(msg.data());
-        fallback.erase(key);
-      } else if (msgType == Update) {
-        char mode = msg[0];
-        Locations locations = *(Locations *) (msg.data() + 1);
-        
-        if (mode == 0) {
-          int off = 1 + sizeof(Locations);
-          uint32_t bs;
-          memcpy(&bs, msg.data() + off, 4);
-          dp->applyUpdate(bs, locations);
-        } else { // mode == 1
-          K k = msg.data() + 1 + sizeof(Locations);
-          fallback.insert(make_pair(k, *(Locations *) (msg.data() + 1)));
+      } else if (msgType == MultiLocate) {  // a malformed key list gets an empty reply
+        vector<K> keys;
+        if (!parseKeys(msg.data(), msg.data() + msg.size(), keys)) {
+          my_write(fd, Return, nullptr, 0);
+          return true;
         }
-      } else if (msgType == UpdateOthello) {
-        runtime_error("not implemented");
-      } else if (msgType == UpdateLudo) {
-        background = new DataPlaneLudo<K, Locations>;
-        
+        vector<Locations> locations = replica.locate(keys);
+        my_write(fd, Return, locations.data(), locations.size() * sizeof(Locations));
+      } else if (msgType == MultiRead) {  // a malformed one is dropped. the client times it out, and reads singly
+        vector<K> keys;
+        if (msg.size() < 8 || !parseKeys(msg.data() + 8, msg.data() + msg.size(), keys)) return true;
         uint32_t *p = (uint32_t *) msg.data();
-        DataPlaneOthello<K, uint8_t, 1> &locator = background->locator;
-        locator.hab.s = *(uint64_t *) p;
-        int i = 2;
-        locator.hd.s = p[i++];
-        locator.ma = p[i++];
-        locator.mb = p[i++];
-        
-        uint64_t sz = (((uint64_t) locator.ma + locator.mb) * locator.VDL + 63) / 64;
-        locator.mem.resize(sz);
-        memcpy(locator.mem.data(), msg.data() + 4 * i, sz * 8);
-        
-        bool notOnlyOthello = msg[4 * i + sz * 8];
-        assert(notOnlyOthello);
-        
-        uint64_t *ps = (uint64_t * )(msg.data() + 4 * i + sz * 8 + 1);
-        background->h.s = ps[0];
-        background->digestH.s = ps[1];
-        uint32_t cnt = background->num_buckets_ = ps[2];
+        uint32_t seq = p[0];
+        string clientAddr = ip + ":" + to_string(p[1]);
         
-        auto *pb = (DataPlaneLudo<K, Locations>::Bucket *) (ps + 3);
-        background->buckets.resize(background->num_buckets_);
-        memcpy(background->buckets.data(), pb, cnt * sizeof(pb[0]));
+        unordered_map<uint32_t, vector<char>> perStorage;
+        vector<uint32_t> misses = groupMultiRead(seq, clientAddr, replica.locate(keys), perStorage);
         
-        mylock_guard g(updateLock);
-        fallback.clear();
-        swap(dp, background);
-        delete background;
+        if (!misses.empty()) {
+          vector<uint32_t> reply = {uint32_t(misses.size())};
+          for (uint32_t i: misses) reply.insert(reply.end(), {i, uint32_t(-1)});
+          my_write(clientAddr, seq, reply.data(), reply.size() * 4);
+        }
+        for (auto &pair: perStorage) {
+          my_write(storages[pair.first].addrPort, MultiRead, pair.second);
+        }
+      } else if (replica.apply(msgType, msg)) {
       } else return false;
     } catch (exception &e) {
     // log(e.what());
@@ -158,15 +312,7 @@ public:
     return true;
   }
   
-  DataPlaneLudo<K, Locations> *dp, *background;
-  unordered_map <K, Locations> fallback;
-  
   inline Locations locate(const K &k) const {
-    mylock_guard g(updateLock);
-    
-    auto it = fallback.find(k);
-    if (it != fallback.end()) return it->second;
-    
-    return dp->lookUp(k);
+    return replica.locate(k);
   }
 };
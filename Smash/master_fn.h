@@ -2,10 +2,12 @@
 
 #include <bitset>
 #include <experimental/filesystem>
+#include <sys/mman.h>
 #include "node.h"
 #include "../utils/CompactArray.h"
 #include "../Ludo/ludo_cp_dp.h"
 #include "../utils/fibonacci_queue.h"
+#include "../utils/free_blocks.h"
 
 using namespace std::experimental;
 
@@ -31,12 +33,29 @@ public:
   
   // dedicated disk blocks one bitmap per disk
   vector <CompactArray<1>> allocated;                   // [disk #] -> bulk bitmap
-  vector <unordered_map<uint32_t, CompactArray<1>>> occupied;  // [disk #] [bulk #] -> block bitmap
+  vector <FreeBlocks> freeBlocks;  // [disk #] -> the blocks of the allocated bulks that are not occupied
   
   vector <pair<uint, uint>> loadInfo;                 // [disk #] -> (# of occupied blocks, # of allocated blocks)
   fibonacci_queue<uint, function < bool(uint, uint)>> leastLoaded;
   vector <uint16_t> lastAvailable;  // [disk #] -> last available bulk. for fast round-robin.
   
+  // objects of up to packLimit bytes are appended to a segment, a block shared by many of them, instead of taking a
+  // block each. a segment is freed once all its objects are removed, and compacted once less than compactRatio of it
+  // is still live
+  inline static double compactRatio = 0.5;
+  inline static uint compactTimeoutMs = 10000;  // for the storage to copy a segment out
+  
+  struct Segment {
+    uint32_t fill = 0, live = 0;      // bytes appended, bytes still referenced
+    map<uint32_t, uint32_t> extents;  // byte offset -> extent of a live object
+    unordered_map<uint32_t, K> keys;  // byte offset -> key of the object, for compaction to relocate
+  };
+  vector <unordered_map<uint32_t, Segment>> segments;  // [disk #] [blkId] -> segment. under loadLock
+  vector <uint32_t> openSegments;                      // [disk #] -> the segment appended to, -1: none
+  set <pair<uint32_t, uint32_t>> sparseSegments;       // (disk #, blkId) waiting for compaction
+  bool compacting = false;
+  pair<uint32_t, uint32_t> compactingSegment = {-1, -1};  // (disk #, blkId) being copied out, not freed meanwhile
+  
   ControlPlaneLudo<K, Locations> ludo;   // ludo is the main table. if the main is under construction, the fallback will buffer the requests.
   unordered_map <K, Locations> fallback;
   // if the fallback is full, no further updates are accepted. after construction, the fallback is merged into main. if merge fails, main rebuild again
@@ -44,106 +63,556 @@ public:
   typedef LudoUpdateResult<K> UpdateResult;
   
   thread daemon, build;
-  vector<int> updateChannels;
+  
+  // the update stream to a lookup or a client replica. handlers only queue the frames, and a sender thread per
+  // channel writes them out, so a slow subscriber holds up neither the replies nor the other subscribers. frames go
+  // as Sequenced, numbered per channel, so the subscriber can tell a gap. a channel more than updateQueueLimit frames
+  // behind drops them all (their numbers are used up) and is sent the whole state instead
+  inline static uint updateQueueLimit = 4096;
+  
+  struct UpdateFrame {
+    uint64_t seq;
+    uint32_t type;
+    shared_ptr<const vector<char>> body;  // shared by the channels
+  };
+  
+  struct UpdateChannel {
+    int fd;
+    mutex lock;
+    condition_variable cv;
+    deque<UpdateFrame> frames;
+    uint64_t seq = 0;  // of the last frame queued
+    bool resync = false, open = true;
+    thread sender;
+  };
+  vector<UpdateChannel *> updateChannels;
 
 //  vector<recursive_mutex> locks;
   recursive_mutex updateLock, sendLock, loadLock;
   bool building = false;
   
+  // a bulk is 256 blocks, 4 words of freeBlocks
   inline bool bulkEmpty(uint32_t dId, uint32_t bulkId) {
-    const uint64_t *mem = occupied[dId].find(bulkId)->second.getMem();
-    return mem[0] == 0 && mem[1] == 0 && mem[2] == 0 && mem[3] == 0;
+    const FreeBlocks &free = freeBlocks[dId];
+    const uint64_t FULL = uint64_t(-1ULL);
+    return free.word(bulkId * 4) == FULL && free.word(bulkId * 4 + 1) == FULL &&
+           free.word(bulkId * 4 + 2) == FULL && free.word(bulkId * 4 + 3) == FULL;
   }
   
   inline bool bulkFull(uint32_t dId, uint32_t bulkId) {
-    const uint64_t *mem = occupied[dId].find(bulkId)->second.getMem();
+    const FreeBlocks &free = freeBlocks[dId];
+    return !free.word(bulkId * 4) && !free.word(bulkId * 4 + 1) && !free.word(bulkId * 4 + 2) &&
+           !free.word(bulkId * 4 + 3);
+  }
+  
+  inline bool blockOccupied(uint32_t dId, uint32_t blkId) {
+    return allocated[dId].memGet(blkId / 256) && !freeBlocks[dId].isFree(blkId);
+  }
+  
+  // the bulk becomes this master's. its blocks are free, except for those set in occupied (4 words) if given
+  void addBulk(uint32_t dId, uint32_t bulkId, const uint64_t *occupied = nullptr) {
+    allocated[dId].memSet(bulkId, 1);
+    uint64_t realBlocks = min<uint64_t>(256, storages[dId].capacity - bulkId * 256ULL);
+    for (uint32_t i = 0; i < 4; ++i) {
+      uint64_t bits = realBlocks >= (i + 1) * 64 ? ~0ULL : realBlocks <= i * 64 ? 0 : (1ULL << (realBlocks - i * 64)) - 1;
+      freeBlocks[dId].setWord(bulkId * 4 + i, occupied ? ~occupied[i] & bits : bits);
+    }
+  }
+  
+  void dropBulk(uint32_t dId, uint32_t bulkId) {
+    allocated[dId].memSet(bulkId, 0);
+    for (uint32_t i = 0; i < 4; ++i) freeBlocks[dId].setWord(bulkId * 4 + i, 0);
+  }
+  
+  // write-ahead log of the key -> locations changes, and now and then a snapshot of all of them. a change is appended
+  // to logPending under updateLock, and its handler waits in commitLog before replying. the first one waiting writes
+  // out all that is pending with one fdatasync, and the others wait for it, so concurrent updates share the sync.
+  // record: <checksum, key length, extent, locations, key>, the checksum (farmhash32) over the rest. extent is the
+  // room of a packed object in its segment. removal: locs[0].dId == -1. a bulk granted to or by another master
+  // (Borrow/Granted) has a record of its own, with no key, extent bulkGained or bulkGiven and locs[0] = {dId, bulkId}.
+  // back/<name>.snapshot is the state when back/<name>.wal.<generation> was started, and the logs go on from there
+  // with generation + 1, ... once they grew past logFileSize, a new snapshot is taken
+  struct LogRecord {
+    uint32_t checksum, keyLength, extent;
+    Locations locations;
+  };
+  
+  inline static const uint32_t bulkGained = -1, bulkGiven = -2;
+  
+  uint64_t logFileSize = 256 * 1024 * 1024;
+  uint32_t logGeneration = 0;
+  int logFile = -1;
+  uint64_t logFileOffset = 0;  // end of the current log
+  uint64_t logBytes = 0;       // in the logs since the snapshot
+  
+  mutex logLock;
+  condition_variable logCv;
+  vector<char> logPending;
+  uint64_t logAppended = 0, logDurable = 0;  // bytes appended so far, and of them on disk
+  bool logFlushing = false, dumping = false;
+  
+  string logName(uint32_t generation) {
+    return "back/" + name + ".wal." + to_string(generation);
+  }
+  
+  static void appendRecord(vector<char> &out, const K &k, const Locations &locations, uint32_t extent) {
+    uint64_t offset = out.size(), length = sizeof(LogRecord) + k.length();
+    out.resize(offset + length);
     
-    const uint64_t FULL = uint64_t(-1ULL);
-    return mem[0] == FULL && mem[1] == FULL && mem[2] == FULL && mem[3] == FULL;
+    auto *record = (LogRecord *) (out.data() + offset);
+    record->keyLength = k.length();
+    record->extent = extent;
+    record->locations = locations;
+    memcpy(record + 1, k.data(), k.length());
+    record->checksum = farmhash::Hash32(out.data() + offset + 4, length - 4);
   }
   
-  inline int bulkFreeIndex(uint32_t dId, uint32_t bulkId) {
-    const uint64_t *mem = occupied[dId].find(bulkId)->second.getMem();
-    int i = 0;
-    while (mem[i] == uint64_t(-1ULL) && i < 4) ++i;
-    if (i == 4) return -1;
+  // applies the records, up to the first torn one. the bytes applied
+  uint64_t replayLog(const char *data, uint64_t size) {
+    uint64_t offset = 0;
+    while (offset + sizeof(LogRecord) <= size) {
+      auto *record = (const LogRecord *) (data + offset);
+      uint64_t length = sizeof(LogRecord) + record->keyLength;
+      if (offset + length > size || record->checksum != farmhash::Hash32(data + offset + 4, length - 4)) break;
+      
+      if (!record->keyLength && record->extent >= bulkGiven) {
+        replayBulk(record->locations.locs[0].dId, record->locations.locs[0].blkId, record->extent == bulkGained);
+      } else {
+        replayRecord(K((const char *) (record + 1), record->keyLength), record->locations, record->extent);
+      }
+      offset += length;
+    }
+    return offset;
+  }
+  
+  void replayRecord(const K &k, const Locations &locations, uint32_t extent) {
+    Locations old;
+    auto it = fallback.find(k);
+    bool found = it != fallback.end() ? (old = it->second, true) : ludo.lookUp(k, old);
+    if (it != fallback.end()) fallback.erase(it);
+    if (found) {
+      for (auto &location: old.locs) unclaim(location);
+    }
     
-    return i * 64 + ffsl(~mem[i]) - 1;
+    if (locations.locs[0].dId == uint32_t(-1)) {
+      ludo.remove(k);
+    } else {
+      ludo.insert(k, locations, false);
+      for (auto &location: locations.locs) claim(location, extent);
+      ownPacked(k, locations);
+    }
   }
   
-  // when the logs are full, aggregated into a new snapshot. In fact, just dump current memory structure is fine
-  int logFile = -1;    // every 4KB, and should be roughly k times larger than the snapshot. Say k=5
-  uint64_t logFileSize = 256 * 1024 * 1024;
-  uint64_t logFileOffset = 0;
-  char logBuffer[4096]; // flush to disk every 4KB
-  uint64_t logBufferOffset = 0;
+  void replayBulk(uint32_t dId, uint32_t bulkId, bool gained) {
+    if (dId >= nStorages) return;
+    
+    mylock_guard g(loadLock);
+    if (gained == bool(allocated[dId].memGet(bulkId))) return;
+    if (gained) addBulk(dId, bulkId);
+    else dropBulk(dId, bulkId);
+    loadInfo[dId].second += gained ? 256 : -256;
+  }
   
-  recursive_mutex dumpLock;
+  static bool readFile(const string &fileName, vector<char> &out) {
+    int f = open(fileName.c_str(), O_RDONLY);
+    if (f < 0) return false;
+    out.resize(lseek(f, 0, SEEK_END));
+    pread(f, out.data(), out.size(), 0);
+    close(f);
+    return true;
+  }
   
-  void dump() {
-    updateLock.lock();
-    vector <u_char> updateMsg = serializeLudo(true);
+  uint32_t extentOf(const Locations &locations) {
+    mylock_guard g(loadLock);
+    for (auto &location: locations.locs) {
+      if (location.dId == uint32_t(-1) || !location.packed()) continue;
+      auto it = segments[location.dId].find(location.blkId);
+      if (it == segments[location.dId].end()) continue;
+      auto extent = it->second.extents.find(location.byteOffset());
+      if (extent != it->second.extents.end()) return extent->second;
+    }
+    return 0;
+  }
+  
+  // under updateLock. the position to pass to commitLog
+  uint64_t appendLog(const K &k, const Locations &locations) {
+    return appendLog(k, locations, extentOf(locations));
+  }
+  
+  // under loadLock, so the allocations from the bulk are logged after it
+  uint64_t appendBulkLog(uint32_t dId, uint32_t bulkId, bool gained) {
+    Locations bulk;
+    bulk.locs[0] = {dId, bulkId};
+    return appendLog(K(), bulk, gained ? bulkGained : bulkGiven);
+  }
+  
+  uint64_t appendLog(const K &k, const Locations &locations, uint32_t extent) {
+    lock_guard<mutex> g(logLock);
+    uint64_t before = logPending.size();
+    appendRecord(logPending, k, locations, extent);
+    logAppended += logPending.size() - before;
+    logBytes += logPending.size() - before;
     
-    logFileOffset = 0;
-    logBufferOffset = 0;
-    logFileSize = updateMsg.size() * 2;
+    if (logBytes > logFileSize && !dumping) {
+      dumping = true;
+      thread(&Master::dump, this).detach();
+    }
+    return logAppended;
+  }
+  
+  // returns once the log is on disk up to position
+  void commitLog(uint64_t position) {
+    unique_lock<mutex> g(logLock);
+    while (logDurable < position) {
+      if (logFlushing) logCv.wait(g);
+      else flushLog(g);
+    }
+  }
+  
+  // writes out all the pending records, with one fdatasync. logLock is let go meanwhile, so the next group gathers
+  void flushLog(unique_lock<mutex> &g) {
+    logFlushing = true;
+    vector<char> group;
+    group.swap(logPending);
+    uint64_t end = logAppended, offset = logFileOffset;
+    logFileOffset += group.size();
+    g.unlock();
     
-    string logFileName = "back/" + name + ".buffer";
-    logFile = open(logFileName.c_str(), O_WRONLY | O_CREAT, 0666);
-    ftruncate(logFile, logFileSize);
-    updateLock.unlock();
+    pwrite(logFile, group.data(), group.size(), offset);
+    fdatasync(logFile);
     
-    mylock_guard g(dumpLock);
-    string tmp = "back/" + name + ".snapshot.new";
-    string snapshotFileName = "back/" + name + ".snapshot";
+    g.lock();
+    logDurable = end;
+    logFlushing = false;
+    logCv.notify_all();
+  }
+  
+  // snapshot image, mapped back on a restart: <SnapshotHeader, BucketImage * nBuckets, keys, disks, fallback>.
+  // the buckets are Ludo CP's own, with its hash seeds and the locator's, so loading is a pass over the image
+  // instead of inserting every key again. keys: <length (u32), bytes> in bucket and slot order. disks, per disk:
+  // <loadInfo, lastAvailable, open segment, the bulk bitmap's words, n, (bulkId, 4 block bitmap words) * n, n,
+  // (blkId, fill, n, (offset, extent) * n) * n>. fallback: log records
+  struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version, generation;
+    uint64_t ludoSeed, digestSeed, locatorSeed;
+    uint32_t locatorDigestSeed, nKeys, capacity, nBuckets, nStorages;
+    uint64_t keysOffset, disksOffset, fallbackOffset, size;
+  };
+  
+  struct BucketImage {
+    uint8_t seed, occupiedMask;
+    Locations values[4];
+  };
+  
+  inline static const uint64_t snapshotMagic = 0x50414e5348534d53ULL;  // "SMSHSNAP"
+  inline static const uint32_t snapshotVersion = 1;
+  
+  // the state a snapshot is made of, copied under updateLock and loadLock: the buckets as they are, the disks and the
+  // fallback serialized already. the image is put together from it after the locks are let go
+  struct SnapshotState {
+    SnapshotHeader header;
+    vector<ControlPlaneLudo<K, Locations>::Bucket> buckets;
+    vector<char> disks, fallback;
+  };
+  
+  // a snapshot of the keys and the disks, after which the logs before it are dropped. it waits out a Ludo rebuild.
+  // the state is copied under updateLock and loadLock, and the log switched to the next generation in the same
+  // critical section, so the snapshot is exactly the state before the new log, bulk records included. the image is
+  // made and written after the locks are let go; until it is renamed in place, a restart takes the old snapshot and
+  // all the logs from its generation on
+  void dump() {
+    SnapshotState state;
+    uint32_t generation;
+    while (true) {
+      mylock_guard g(updateLock);
+      if (building) {
+        g.release();
+        this_thread::sleep_for(chrono::seconds(1));
+        continue;
+      }
+      
+      mylock_guard gl(loadLock);  // bulk records are appended under it alone
+      generation = logGeneration + 1;
+      snapshotState(generation, state);
+      
+      // the changes from here on go to a new log. the current one is complete once its pending records are out
+      unique_lock<mutex> glog(logLock);
+      while (logFlushing) logCv.wait(glog);
+      if (!logPending.empty()) flushLog(glog);
+      
+      close(logFile);
+      logGeneration = generation;
+      logFile = open(logName(generation).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      logFileOffset = 0;
+      logBytes = 0;
+      break;
+    }
+    
+    vector<char> image = snapshotImage(state);
+    state = SnapshotState();
     
-    int f = open(tmp.c_str(), O_WRONLY | O_CREAT, 0666);
-    ftruncate(f, updateMsg.size());
-    pwrite(f, updateMsg.data(), updateMsg.size(), 0);
+    string tmp = "back/" + name + ".snapshot.new";
+    int f = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    uint64_t size = image.size();
+    for (uint64_t written = 0; written < size;) {  // 1MB at a time
+      ssize_t n = pwrite(f, image.data() + written, min<uint64_t>(size - written, 1024 * 1024), written);
+      if (n <= 0) break;
+      written += n;
+    }
+    vector<char>().swap(image);
+    fdatasync(f);
     close(f);
+    filesystem::rename(tmp, "back/" + name + ".snapshot");
+    int dir = open("back", O_RDONLY);
+    fsync(dir);
+    close(dir);
+    
+    for (uint32_t old = generation; old-- > 0 && unlink(logName(old).c_str()) == 0;) {}
     
-    filesystem::rename(tmp, snapshotFileName);
+    lock_guard<mutex> g(logLock);
+    logFileSize = max<uint64_t>(logFileSize, size * 2);
+    dumping = false;
   }
   
-  // already synchronized by updateLock, just think as a single thread
-  inline void appendLog(string &k, Locations &locations) {
-    uint kOffset = 0;
+  // under updateLock and loadLock
+  void snapshotState(uint32_t generation, SnapshotState &state) {
+    auto put = [&](const void *data, size_t length) {
+      state.disks.insert(state.disks.end(), (const char *) data, (const char *) data + length);
+    };
     
-    while (logBufferOffset + k.length() + 1 > 4096) {
-      uint64_t toWrite = 4096 - logBufferOffset;
-      memcpy(logBuffer + logBufferOffset, k.data() + kOffset, toWrite);
-      pwrite(logFile, logBuffer, 4096, logFileOffset);
+    state.header = {snapshotMagic, snapshotVersion, generation, ludo.h.s, ludo.digestH.s, ludo.locator.hab.s,
+                    ludo.locator.hd.s, ludo.nKeys, ludo.capacity, ludo.num_buckets_, nStorages,
+                    0, 0, 0, 0};  // the offsets, set by snapshotImage
+    state.buckets = ludo.buckets_;
+    
+    for (uint dId = 0; dId < nStorages; ++dId) {
+      uint32_t fixed[4] = {loadInfo[dId].first, loadInfo[dId].second, lastAvailable[dId], openSegments[dId]};
+      put(fixed, sizeof(fixed));
+      put(allocated[dId].getMem(), (allocated[dId].capacity + 63) / 64 * 8);
       
-      logBufferOffset = 0;
-      kOffset += toWrite;
-      logFileOffset += 4096;
+      vector <uint32_t> bulks;
+      for (uint32_t bulkId = 0; bulkId < allocated[dId].capacity; ++bulkId) {
+        if (allocated[dId].memGet(bulkId)) bulks.push_back(bulkId);
+      }
+      uint32_t n = bulks.size();
+      put(&n, 4);
+      for (uint32_t bulkId: bulks) {
+        uint64_t occupied[4];
+        for (uint32_t i = 0; i < 4; ++i) occupied[i] = ~freeBlocks[dId].word(bulkId * 4 + i);
+        put(&bulkId, 4);
+        put(occupied, 32);
+      }
       
-      if (logFileOffset > logFileSize) {
-        dump();
-        return;
+      n = segments[dId].size();
+      put(&n, 4);
+      for (auto &segment: segments[dId]) {
+        uint32_t head[3] = {segment.first, segment.second.fill, uint32_t(segment.second.extents.size())};
+        put(head, sizeof(head));
+        for (auto &extent: segment.second.extents) put(&extent, 8);
+      }
+    }
+    
+    for (pair<const K, Locations> &pair: fallback) {
+      appendRecord(state.fallback, pair.first, pair.second, extentOf(pair.second));
+    }
+  }
+  
+  // the whole image, in memory
+  static vector<char> snapshotImage(const SnapshotState &state) {
+    SnapshotHeader header = state.header;
+    vector<char> buffer(sizeof(SnapshotHeader));
+    buffer.reserve(sizeof(SnapshotHeader) + state.buckets.size() * sizeof(BucketImage) * 2 + state.disks.size() +
+                   state.fallback.size());
+    auto put = [&](const void *data, size_t length) {
+      buffer.insert(buffer.end(), (const char *) data, (const char *) data + length);
+    };
+    
+    for (auto &b: state.buckets) {
+      BucketImage image = {b.seed, b.occupiedMask, {}};
+      for (int s = 0; s < 4; ++s) image.values[s] = b.values[s];
+      put(&image, sizeof(image));
+    }
+    
+    header.keysOffset = buffer.size();
+    for (auto &b: state.buckets) {
+      for (int s = 0; s < 4; ++s) {
+        if (!(b.occupiedMask & (1 << s))) continue;
+        uint32_t length = b.keys[s].length();
+        put(&length, 4);
+        put(b.keys[s].data(), length);
       }
     }
     
-    unsigned long toWrite = k.length() + 1 - kOffset;
-    memcpy(logBuffer + logBufferOffset, k.data() + kOffset, toWrite);
-    logBufferOffset += toWrite;
+    header.disksOffset = buffer.size();
+    put(state.disks.data(), state.disks.size());
+    
+    header.fallbackOffset = buffer.size();
+    put(state.fallback.data(), state.fallback.size());
     
-    if (logBufferOffset + sizeof(Locations) > 4096) {
-      toWrite = 4096 - logBufferOffset;
-      memcpy(logBuffer + logBufferOffset, &locations, toWrite);
-      pwrite(logFile, logBuffer, 4096, logFileOffset);
+    header.size = buffer.size();
+    memcpy(buffer.data(), &header, sizeof(header));
+    return buffer;
+  }
+  
+  // loads the snapshot image through mmap. false if there is none, or not one of this version and topology
+  bool loadSnapshot(uint32_t &generation) {
+    string fileName = "back/" + name + ".snapshot";
+    int f = open(fileName.c_str(), O_RDONLY);
+    if (f < 0) return false;
+    uint64_t size = lseek(f, 0, SEEK_END);
+    auto *image = size >= sizeof(SnapshotHeader) ? (char *) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, f, 0) : (char *) MAP_FAILED;
+    close(f);
+    if (image == MAP_FAILED) return false;
+    madvise(image, size, MADV_SEQUENTIAL);
+    
+    auto *header = (const SnapshotHeader *) image;
+    if (header->magic != snapshotMagic || header->version != snapshotVersion || header->size != size ||
+        header->nStorages != nStorages) {
+      cerr << fileName << " is not a snapshot this master can load" << endl;
+      munmap(image, size);
+      return false;
+    }
+    generation = header->generation;
+    
+    // Ludo CP, as it was: the buckets, and the locator built over their keys with the same seeds
+    ludo.num_buckets_ = header->nBuckets;
+    ludo.capacity = header->capacity;
+    ludo.nKeys = header->nKeys;
+    ludo.h.setSeed(header->ludoSeed);
+    ludo.digestH.setSeed(header->digestSeed);
+    ludo.buckets_.assign(header->nBuckets, ludo.empty_bucket);
+    
+    auto &locator = ludo.locator;
+    locator.resizeCapacity(header->capacity, false, true);
+    locator.hab.setSeed(header->locatorSeed);
+    locator.hd.setSeed(header->locatorDigestSeed);
+    locator.nKeysInOthello = 0;
+    
+    auto *images = (const BucketImage *) (image + sizeof(SnapshotHeader));
+    const char *key = image + header->keysOffset;
+    for (uint32_t bid = 0; bid < header->nBuckets; ++bid) {
+      auto &b = ludo.buckets_[bid];
+      b.seed = images[bid].seed;
+      b.occupiedMask = images[bid].occupiedMask;
+      for (int s = 0; s < 4; ++s) {
+        if (!(b.occupiedMask & (1 << s))) continue;
+        uint32_t length = *(const uint32_t *) key;
+        b.keys[s].assign(key + 4, length);
+        b.values[s] = images[bid].values[s];
+        key += 4 + length;
+        
+        uint32_t buckets[2];
+        ludo.fast_map_to_buckets(ludo.h(b.keys[s]), buckets, header->nBuckets);
+        locator.keys[locator.nKeysInOthello] = b.keys[s];
+        locator.values[locator.nKeysInOthello++] = bid != buckets[0];
+      }
+    }
+    if (!locator.tryBuild()) locator.build();
+    
+    const char *at = image + header->disksOffset;
+    auto take = [&at](void *to, size_t length) {
+      memcpy(to, at, length);
+      at += length;
+    };
+    mylock_guard g(loadLock);
+    for (uint dId = 0; dId < nStorages; ++dId) {
+      uint32_t fixed[4], n;
+      take(fixed, sizeof(fixed));
+      loadInfo[dId] = {fixed[0], fixed[1]};
+      lastAvailable[dId] = fixed[2];
+      openSegments[dId] = fixed[3];
+      take(allocated[dId]._m.data(), (allocated[dId].capacity + 63) / 64 * 8);
       
-      logBufferOffset = 0;
-      logFileOffset += 4096;
+      freeBlocks[dId] = FreeBlocks(allocated[dId].capacity * 256);
+      take(&n, 4);
+      for (uint32_t i = 0; i < n; ++i) {
+        uint32_t bulkId;
+        uint64_t occupied[4];
+        take(&bulkId, 4);
+        take(occupied, 32);
+        addBulk(dId, bulkId, occupied);
+      }
       
-      if (logFileOffset > logFileSize) {
-        dump();
-        return;
+      segments[dId].clear();
+      take(&n, 4);
+      for (uint32_t i = 0; i < n; ++i) {
+        uint32_t head[3];
+        take(head, sizeof(head));
+        Segment &segment = segments[dId][head[0]];
+        segment.fill = head[1];
+        for (uint32_t j = 0; j < head[2]; ++j) {
+          pair<uint32_t, uint32_t> extent;
+          take(&extent, 8);
+          segment.extents.insert(extent);
+          segment.live += extent.second;
+        }
       }
     }
     
-    memcpy(logBuffer + logBufferOffset, (char *) &locations + toWrite, sizeof(Locations) - toWrite);
-    logBufferOffset += sizeof(Locations) - toWrite;
+    for (auto &b: ludo.buckets_) {
+      for (int s = 0; s < 4; ++s) {
+        if (b.occupiedMask & (1 << s)) ownPacked(b.keys[s], b.values[s]);
+      }
+    }
+    
+    replayLog(image + header->fallbackOffset, size - header->fallbackOffset);
+    munmap(image, size);
+    return true;
+  }
+  
+  // the state before a restart: the snapshot, then the logs from its generation on. a torn record (cut by the
+  // crash) ends them, and the last log is appended to from there
+  void recover() {
+    uint32_t generation = 0;
+    loadSnapshot(generation);
+    
+    vector<char> file;
+    logGeneration = generation;
+    for (uint32_t g = generation; readFile(logName(g), file); ++g) {
+      logGeneration = g;
+      logFileOffset = replayLog(file.data(), file.size());
+      logBytes += logFileOffset;
+    }
+    logFile = open(logName(logGeneration).c_str(), O_WRONLY | O_CREAT, 0666);
+    ftruncate(logFile, logFileOffset);
+  }
+  
+  // marks the block of a recovered location used. the bulks are ours by the snapshot and the bulk records, so a
+  // block in another master's bulk only keeps its segment extent here
+  void claim(const Location &location, uint32_t extent) {
+    if (location.dId >= nStorages) return;
+    uint dId = location.dId, bulkId = location.blkId / 256;
+    
+    mylock_guard g(loadLock);
+    if (location.packed() && !segments[dId][location.blkId].extents.count(location.byteOffset())) {
+      Segment &segment = segments[dId][location.blkId];
+      segment.extents[location.byteOffset()] = extent;
+      segment.live += extent;
+      segment.fill = max(segment.fill, location.byteOffset() + extent);
+    }
+    if (allocated[dId].memGet(bulkId) && !blockOccupied(dId, location.blkId)) occupy(dId, location.blkId, false);
+  }
+  
+  // the reverse of claim, for a location a later record replaced
+  void unclaim(const Location &location) {
+    if (location.dId >= nStorages) return;
+    uint dId = location.dId;
+    
+    mylock_guard g(loadLock);
+    if (location.packed()) {
+      auto it = segments[dId].find(location.blkId);
+      if (it == segments[dId].end() || !it->second.extents.count(location.byteOffset())) return;
+      
+      Segment &segment = it->second;
+      segment.live -= segment.extents[location.byteOffset()];
+      segment.extents.erase(location.byteOffset());
+      segment.keys.erase(location.byteOffset());
+      if (segment.live) return;
+      segments[dId].erase(it);
+    }
+    
+    if (blockOccupied(dId, location.blkId)) release(dId, location.blkId, false);
   }
 
 // after registration, we know the whole system, and initialize accordingly
@@ -153,59 +622,49 @@ public:
     
     filesystem::create_directory("back");
     
-    string logFileName = "back/" + name + ".buffer";
-    logFile = open(logFileName.c_str(), O_WRONLY | O_CREAT, 0666);
-    logFileSize = 256 * 1024 * 1024;
-    ftruncate(logFile, logFileSize);
-    
-    uint64_t sumCap = 0;
-    for (auto info:storages) {
-      sumCap += info.capacity;
-    }
-    
-    uint32_t cap = sumCap / nShards;
+    uint32_t cap = shardCapacity();
     ludo.resizeCapacity(cap);
     ludo.setSeed(thisId * 0xe2211);
     fallback.reserve(cap / 10);
     
     for (uint lId: getLookupNodes(thisId)) {
-      updateChannels.push_back(connectToServer(lookups[lId].addrPort));
+      addChannel(connectToServer(lookups[lId].addrPort));
     }
     
     loadInfo.resize(nStorages);
     lastAvailable.resize(nStorages);
+    segments.resize(nStorages);
+    openSegments.assign(nStorages, -1);
     
     allocated.reserve(nStorages);
-    occupied.resize(nStorages);
+    freeBlocks.resize(nStorages);
 //    keysAtSn.reserve(nStorages);
     
     for (uint dId = 0; dId < storages.size(); ++dId) {
       auto &info = storages[dId];
       uint64_t nBulks = (info.capacity + 255) / 256;   // 1GiB bulk
       allocated.emplace_back(nBulks);
+      freeBlocks[dId] = FreeBlocks(nBulks * 256);
       
-      auto &_occupied = occupied[dId];
-      CompactArray<1> &_allocated = allocated.back();
       pair <uint, uint> &_load = loadInfo[dId];
       
       for (int bulkId = 0; bulkId < nBulks; ++bulkId) {
         if (bulkId * nMasters / nBulks == thisId) {
-          _allocated.memSet(bulkId, 1);   // initially, the disks are evenly allocated to masters
-          CompactArray<1> y = CompactArray<1>(256);
+          addBulk(dId, bulkId);   // initially, the disks are evenly allocated to masters
           uint realBlocks = 256;
           if (bulkId == nBulks - 1 && info.capacity % 256) {
             realBlocks = info.capacity % 256;
-            
-            for (int i = realBlocks; i < 256; ++i) {
-              y.memSet(i, 1);
-            }
           }
-          _occupied.insert(make_pair(bulkId, y));
           _load.second += realBlocks;
         }
       }
     }
     
+    recover();
+    if (ludo.size()) {  // the lookups may know an older state, or none
+      publish(UpdateLudo, serializeLudo(true));
+    }
+    
     for (uint i = 0; i < nStorages; ++i) {
       leastLoaded.push(i);
     }
@@ -234,9 +693,22 @@ public:
   void stop() {
     Node::stop();
     
-    for (int fd: updateChannels) {
-      close(fd);
+    for (UpdateChannel *channel: updateChannels) {
+      {
+        lock_guard<mutex> g(channel->lock);
+        channel->open = false;
+      }
+      channel->cv.notify_one();
+      shutdown(channel->fd, SHUT_RDWR);  // in case the sender is stuck on a subscriber that does not read
+      channel->sender.join();
+      close(channel->fd);
+      delete channel;
     }
+    updateChannels.clear();
+    
+    mylock_guard g(subscriberLock);
+    for (auto &pair: subscribers) dropSubscriber(pair.second);
+    subscribers.clear();
   }
   
   void onBorrowMsg(uint32_t mId, uint32_t dId, uint32_t nBulks) {
@@ -249,6 +721,7 @@ public:
     p[1] = dId;
     CompactArray<1> grantedBitmap(bulkAllocBitmap.capacity, p + 2);
     uint cnt = 0;
+    uint64_t logged = 0;
     
     mylock_guard g(loadLock);
     for (uint bulkId = 0; bulkId < bulkAllocBitmap.capacity && cnt < nBulks; ++bulkId) {
@@ -256,8 +729,8 @@ public:
       
       if (bulkEmpty(dId, bulkId)) {  // assuming fixed 256 blocks in a bulk
         grantedBitmap.memSet(bulkId, 1);
-        allocated[dId].memSet(bulkId, 0);
-        occupied[dId].erase(bulkId);
+        dropBulk(dId, bulkId);
+        logged = appendBulkLog(dId, bulkId, false);
         cnt++;
       }
     }
@@ -266,6 +739,7 @@ public:
     
     g.release();
     
+    commitLog(logged);  // given up for good before the borrower can use it
     my_write(nameServer, Granted, msg);
     my_write(masters[mId].addrPort, Granted, msg);
   }
@@ -283,21 +757,23 @@ public:
     uint64_t nBulks = (storages[dId].capacity + 255) / 256;
     
     CompactArray<1> bitmap(nBulks, p + 2);
-    CompactArray<1> &_allocated = allocated[dId];
-    unordered_map <uint32_t, CompactArray<1>> &_occupied = occupied[dId];
     
     mylock_guard g(loadLock);
     uint cnt = 0;
+    uint64_t logged = 0;
     for (uint64_t bulkId = 0; bulkId < nBulks; ++bulkId) {
       if (!bitmap.memGet(bulkId)) continue;
 //      if (allocated[dId][bulkId] == fromMasterId)  // we assume nodes are honest
-      _allocated.memSet(bulkId, 1);
-      _occupied.insert(make_pair(bulkId, CompactArray<1>(256)));
+      addBulk(dId, bulkId);
+      logged = appendBulkLog(dId, bulkId, true);
       cnt++;
     }
     
     loadInfo[dId].second += cnt * 256;
     if (cnt) leastLoaded.increase(dId);
+    g.release();
+    
+    commitLog(logged);
   }
   
   void sendLoadInfo() {
@@ -401,6 +877,108 @@ public:
     return updateMsg;
   }
   
+  // under updateLock. finds the locations of k, or allocates them and inserts k into ludo (into the fallback while
+  // building). true if k is new, and then updateMsg is the Insert message for the lookups
+  bool insertKey(const K &k, uint32_t size, bool striped, Locations &locations, vector <u_char> &updateMsg) {
+    bool found = false;
+    
+    auto it = fallback.find(k);
+    if ((found = it != fallback.end())) {
+      locations = it->second;
+    } else if ((found = ludo.lookUp(k, locations))) {
+    } else {
+      striped &= striping && nStorages >= locationSlots;  // not built in, or too few disks: replicated instead
+      locations = packLimit && size <= packLimit ? allocatePacked(size) : allocate(k, this, striped ? locationSlots : 3);
+      if (striped && !locations.locs[0].packed()) stripe(locations, size);
+      if (locations.locs[0].packed()) ownPacked(k, locations);
+      
+      int i = 0;
+      if (locations.locs[i++].dId == (uint32_t) - 1 || locations.locs[i++].dId == (uint32_t) - 1 || locations.locs[i++].dId == (uint32_t) - 1) {
+        ostringstream oss;
+        oss << "Locations for key " << k << " not fully allocated. Allocated: " << to_string(i) << endl;
+        oss << "Not found key. Allocation failed. ";
+        
+      // log(oss.str());
+      }
+    }
+    
+  // log((found ? "Found key " : "Not found key ") + k);
+    
+    if (!found) {
+      if (building || (full_debug && rand() > INT_MAX / 4 * 3)) {
+        fallback.insert(make_pair(k, locations));
+        updateMsg.resize(1 + sizeof(Locations) + k.length() + 1);
+        
+        *updateMsg.data() = 1;
+        memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
+        memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
+      } else {
+        // insert these locations to local Ludo-CP
+        UpdateResult result = ludo.insert(k, locations);
+        if (result.status == 0 && (!full_debug || ludo.nKeys <= 3)) {
+          // handle each path entry. caution with the last entry: it may indicate a rebuild in Othello
+          // msg format: <0, locations, <lenOfCC, bid:sid, newSeed, slots. CC> * many>
+          // lenOfCC<0 means othello is being reconstructed, so the msg contains the full key at the position of CC
+          // -1: first bucket. -2: second bucket
+          updateMsg.reserve(1000);
+          updateMsg.resize(sizeof(Locations) + 1);
+          *updateMsg.data() = 0;
+          memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
+          
+          for (auto &entry: result.path) {
+            uint len = 10 + (entry.status < 0 ? (k.length() + 1) : entry.status * 4);
+            uint i = updateMsg.size();
+            updateMsg.resize(i + len);
+            
+            memcpy(updateMsg.data() + i, &entry, 10);
+            memcpy(updateMsg.data() + i + 10, entry.locatorCC.data(), entry.status * 4);
+          }
+        } else {
+          if (!full_debug && !(result.status == -1 || result.status == -2))
+            throw runtime_error("impossible");
+          
+          // just update the fallback table in DP. msg format: <1, locations, key>
+          updateMsg.resize(1 + sizeof(Locations) + (k.length() + 1));
+          *updateMsg.data() = 1;
+          memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
+          memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
+          
+          building = true;
+          fallback.insert(make_pair(k, locations));
+          // if ==1, only rebuild othello.
+          // if ==2, rebuild whole ludo
+          build = thread([this, result, k, locations]() {
+            Clocker c("rebuild");
+            // build in the background. in the meantime, the fallback table will handle all updates
+            if (result.status == -1 || (full_debug && (rand() & 1))) {
+              ludo.locator.build();
+            } else {
+              ludo.resizeCapacity(ludo.capacity + 1);  // will double
+            }
+            
+            // after necessary rebuilding, insert all buffered kv. halt the update for a while, much shorter than the whole build time
+            updateLock.lock();
+            
+            ludo.Merge(fallback, [](const Locations &locs) -> bool { return locs.locs[0].dId != uint32_t(-1); });
+            bool notOnlyOthello = true;  // currently, we do not cope with intact ludo. because that is rare, after merging
+            
+            vector <u_char> updateMsg = serializeLudo(notOnlyOthello);
+            
+            building = false;
+            
+            // make sure sending out the update msg before accepting new updates becasue OOO insertions breaks the integrity of Ludo
+            // send the update messages to lookups
+            mylock_guard gg(sendLock);
+            updateLock.unlock();
+            publish(UpdateOthello + notOnlyOthello, updateMsg);
+          });
+          build.detach();
+        }
+      }
+    }
+    return !found;
+  }
+  
   bool onMessage(int msgType, int id, const int fd, const string &ip, vector<char> &msg) override {
     if (Node::onMessage(msgType, 0, fd, ip, msg)) return true;
     
@@ -411,113 +989,22 @@ public:
       updateLock.lock();
       
       K k(msg.data());
+      uint32_t size = msg.size() >= k.length() + 1 + 4 ? *(uint32_t *) (msg.data() + k.length() + 1) : blockSize;
+      bool striped = msg.size() >= k.length() + 1 + 5 && msg[k.length() + 1 + 4];
       // find *nReplicas* suitable locations for k
       Locations locations;
-      bool found = false;
-      
-      auto it = fallback.find(k);
-      if ((found = it != fallback.end())) {
-        locations = it->second;
-      } else if ((found = ludo.lookUp(k, locations))) {
-      } else {
-        locations = allocate(k, this, 3);
-        
-        int i = 0;
-        if (locations.locs[i++].dId == (uint32_t) - 1 || locations.locs[i++].dId == (uint32_t) - 1 || locations.locs[i++].dId == (uint32_t) - 1) {
-          ostringstream oss;
-          oss << "Locations for key " << k << " not fully allocated. Allocated: " << to_string(i) << endl;
-          oss << "Not found key. Allocation failed. ";
-          
-        // log(oss.str());
-        }
-      }
-      
-    // log((found ? "Found key " : "Not found key ") + k);
+      vector <u_char> updateMsg;
+      uint64_t logged = 0;
+      bool found = !insertKey(k, size, striped, locations, updateMsg);
       
       if (!found) {
-        vector <u_char> updateMsg;
-        if (building || (full_debug && rand() > INT_MAX / 4 * 3)) {
-          fallback.insert(make_pair(k, locations));
-          updateMsg.resize(1 + sizeof(Locations) + k.length() + 1);
-          
-          *updateMsg.data() = 1;
-          memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
-          memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
-        } else {
-          // insert these locations to local Ludo-CP
-          UpdateResult result = ludo.insert(k, locations);
-          if (result.status == 0 && (!full_debug || ludo.nKeys <= 3)) {
-            // handle each path entry. caution with the last entry: it may indicate a rebuild in Othello
-            // msg format: <0, locations, <lenOfCC, bid:sid, newSeed, slots. CC> * many>
-            // lenOfCC<0 means othello is being reconstructed, so the msg contains the full key at the position of CC
-            // -1: first bucket. -2: second bucket
-            updateMsg.reserve(1000);
-            updateMsg.resize(sizeof(Locations) + 1);
-            *updateMsg.data() = 0;
-            memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
-            
-            for (auto &entry: result.path) {
-              uint len = 10 + (entry.status < 0 ? (k.length() + 1) : entry.status * 4);
-              uint i = updateMsg.size();
-              updateMsg.resize(i + len);
-              
-              memcpy(updateMsg.data() + i, &entry, 10);
-              memcpy(updateMsg.data() + i + 10, entry.locatorCC.data(), entry.status * 4);
-            }
-          } else {
-            if (!full_debug && !(result.status == -1 || result.status == -2))
-              throw runtime_error("impossible");
-            
-            // just update the fallback table in DP. msg format: <1, locations, key>
-            updateMsg.resize(1 + sizeof(Locations) + (k.length() + 1));
-            *updateMsg.data() = 1;
-            memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
-            memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
-            
-            building = true;
-            fallback.insert(make_pair(k, locations));
-            // if ==1, only rebuild othello.
-            // if ==2, rebuild whole ludo
-            build = thread([this, result, k, locations]() {
-              Clocker c("rebuild");
-              // build in the background. in the meantime, the fallback table will handle all updates
-              if (result.status == -1 || (full_debug && (rand() & 1))) {
-                ludo.locator.build();
-              } else {
-                ludo.resizeCapacity(ludo.capacity + 1);  // will double
-              }
-              
-              // after necessary rebuilding, insert all buffered kv. halt the update for a while, much shorter than the whole build time
-              updateLock.lock();
-              
-              ludo.Merge(fallback, [](const Locations &locs) -> bool { return locs.locs[0].dId != uint32_t(-1); });
-              bool notOnlyOthello = true;  // currently, we do not cope with intact ludo. because that is rare, after merging
-              
-              vector <u_char> updateMsg = serializeLudo(notOnlyOthello);
-              
-              building = false;
-              
-              // make sure sending out the update msg before accepting new updates becasue OOO insertions breaks the integrity of Ludo
-              // send the update messages to lookups
-              mylock_guard gg(sendLock);
-              updateLock.unlock();
-              for (int fd: updateChannels) {
-                my_write(fd, UpdateOthello + notOnlyOthello, updateMsg);
-              }
-            });
-            build.detach();
-          }
-        }
-        
-        appendLog(k, locations);
+        logged = appendLog(k, locations);
         
         mylock_guard gg(sendLock);
         updateLock.unlock();
         
-        // send the update messages to lookups
-        for (int fd: updateChannels) {
-          my_write(fd, Insert, updateMsg);
-        }
+        // queue the update messages to lookups. the reply does not wait for them
+        publish(Insert, updateMsg);
       } else {
       // log("Rested to insert an existing key: " + k + ", first disk storing it: " + to_string(locations.locs[0].dId));
         updateLock.unlock();
@@ -550,8 +1037,55 @@ public:
       
     // log("Locations for key " + k + " " + to_string(locations.locs[0].dId));
       
-      // send back the locations to client
+      // send back the locations to client, once they are durable
+      commitLog(logged);
       my_write(fd, Return, &locations, sizeof(Locations));
+    } else if (msgType == MultiInsert) {  // as many Inserts, under one lock, with one log commit and one update frame
+      // <n, (k, size, striped) * n>, checked whole before any key is taken. a malformed frame gets an empty reply
+      vector <const char *> records;
+      const char *p = msg.data() + 4, *end = msg.data() + msg.size();
+      uint32_t n = msg.size() >= 4 ? *(uint32_t *) msg.data() : 0;
+      while (records.size() < n && p < end) {
+        const char *terminator = (const char *) memchr(p, 0, end - p);
+        if (!terminator || terminator + 1 + 5 > end) break;
+        records.push_back(p);
+        p = terminator + 1 + 5;
+      }
+      if (msg.size() < 4 || records.size() != n || p != end) {
+        my_write(fd, Return, nullptr, 0);
+        return true;
+      }
+      
+      vector <Locations> replies(n);
+      vector <u_char> batch(4), updateMsg;  // <n, (length, Insert message) * n> of the new keys
+      uint32_t nNew = 0;
+      uint64_t logged = 0;
+      
+      updateLock.lock();
+      for (uint32_t i = 0; i < n; ++i) {
+        K k(records[i]);
+        uint32_t size = *(uint32_t *) (records[i] + k.length() + 1);
+        bool striped = records[i][k.length() + 1 + 4];
+        
+        updateMsg.clear();
+        if (!insertKey(k, size, striped, replies[i], updateMsg)) continue;
+        
+        logged = appendLog(k, replies[i]);
+        uint32_t length = updateMsg.size();
+        batch.insert(batch.end(), (u_char *) &length, (u_char *) &length + 4);
+        batch.insert(batch.end(), updateMsg.begin(), updateMsg.end());
+        nNew++;
+      }
+      memcpy(batch.data(), &nNew, 4);
+      
+      {
+        mylock_guard gg(sendLock);
+        updateLock.unlock();
+        if (nNew) publish(MultiInsert, batch);
+      }
+      
+      commitLog(logged);
+      my_write(fd, Return, replies.data(), n * sizeof(Locations));
     } else if (msgType == Remove) {
       mylock_guard g(updateLock);
       K k(msg.data());
@@ -560,7 +1094,12 @@ public:
         fallback.insert(make_pair(k, Locations()));
       } else {
         Locations locations;
-        if (!locate(k, locations)) return false;
+        if (!locate(k, locations)) {  // absent, e.g., removed by an attempt whose reply was lost
+          g.release();
+          uint8_t succ = false;
+          my_write(fd, Return, &succ, 1);
+          return true;
+        }
         
         // remove from local Ludo-CP
         UpdateResult result = ludo.remove(k);
@@ -568,66 +1107,64 @@ public:
         // remove from remote Ludo-DPs, very limited work
         if (result.status == 1) {
           mylock_guard gg(sendLock);
-          for (int fd: updateChannels) {
-            my_write(fd, Remove, k);
-          }
+          publish(Remove, k);
         } else {} // fine with the ludo dp
         
         // remove from storage, skipped
         
         // update load records
-        for (int i = 0; i < 3; ++i) {
-          Location &location = locations.locs[i];
-          release(location.dId, location.blkId);
+        bool packed = false;
+        for (Location &location: locations.locs) {
+          if (location.dId == uint32_t(-1)) continue;
+          if (location.packed()) {
+            packed = true;
+            releasePacked(location);
+          } else {
+            release(location.dId, location.blkId);
+          }
         }
+        
+        // the storages index the objects in their segments
+        if (packed) call(storages[locations.locs[0].dId].addrPort, Remove, &locations, sizeof(Locations));
       }
       
+      notifySubscribers(k, Locations());
+      
       Locations locations;
       locations.locs[0].dId = -1;  // mark as deleted
-      appendLog(k, locations);
+      uint64_t logged = appendLog(k, locations);
+      g.release();
+      commitLog(logged);
       
     // log("Locations for key " + k + to_string(locations.locs[0].dId));
       uint8_t succ = true;
       my_write(fd, Return, &succ, 1);
+    } else if (msgType == Subscribe) {
+      uint16_t port = *(uint16_t *) msg.data();
+      addSubscriber(ip + ":" + to_string(port));
+    } else if (msgType == SubscribeLudo) {
+      uint16_t port = *(uint16_t *) msg.data();
+      addReplica(ip + ":" + to_string(port));
     } else if (msgType == Granted) {
       onGrantedMsg(id, msg);
     } else if (msgType == Leave) {
       // direct the data move. Just for performance test, and do not maintain whole system consistency.
+      // the keys keep the leaving replica until Migrated confirms its copy (see relocate)
       uint32_t sId = *(uint32_t *) msg.data();
       storages[sId].in = false;
       
-      vector <u_char> updateMsg;
-      updateMsg.reserve(500);
+      Migrations moves;
       
       mylock_guard g(updateLock);
       for (pair<const K, Locations> &pair:fallback) {
         const K &k = pair.first;
         auto &locs = pair.second.locs;
-        int i = 0;
-        while (locs[i].dId != sId && i < 3) ++i;
+        uint i = 0;
+        while (i < locationSlots && locs[i].dId != sId) ++i;
         
-        if (i == 3) continue;
+        if (i == locationSlots) continue;
         
-        locs[i] = allocateDefault(k, this, 1).locs[0];
-        
-        int j = (i + 1) % 3;
-        // copy to storage node: j to i
-        updateMsg.resize(12);
-        uint32_t *p = (uint32_t *) updateMsg.data();
-        p[0] = locs[j].blkId;
-        p[1] = locs[i].dId;
-        p[2] = locs[i].blkId;
-        my_write(storages[j].addrPort, Copy, updateMsg);
-        
-        // send the update to lookups
-        updateMsg.resize(1 + sizeof(Locations) + k.length() + 1);
-        
-        *updateMsg.data() = 1;
-        memcpy(updateMsg.data() + 1, &locs, sizeof(Locations));
-        memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
-        for (int fd: updateChannels) {
-          my_write(fd, Update, updateMsg);
-        }
+        moveReplica(moves, k, locs, i, allocateDefault(k, this, 1).locs[0], false);
       }
       
       for (uint64_t bid = 0; bid < ludo.num_buckets_; ++bid) {
@@ -637,36 +1174,16 @@ public:
           
           const K &k = b.keys[s];
           auto &locs = b.values[s].locs;
-          int i = 0;
-          while (locs[i].dId != sId && i < 3) ++i;
+          uint i = 0;
+          while (i < locationSlots && locs[i].dId != sId) ++i;
           
-          if (i == 3) continue;
+          if (i == locationSlots) continue;
           
-          locs[i] = allocateDefault(k, this, 1).locs[0];
-          
-          int j = (i + 1) % 3;
-          // copy to storage node: j to i
-          updateMsg.resize(12);
-          uint32_t *p = (uint32_t *) updateMsg.data();
-          p[0] = locs[j].blkId;
-          p[1] = locs[i].dId;
-          p[2] = locs[i].blkId;
-          my_write(storages[j].addrPort, Copy, updateMsg);
-          
-          // send the update messages to lookups
-          updateMsg.resize(1 + 4 + sizeof(Locations));
-          //std::this_thread::yield();
-          
-          *updateMsg.data() = 0;
-          uint32_t bs = (bid << 2) + s;
-          memcpy(updateMsg.data() + 1, &locs, sizeof(Locations));
-          memcpy(updateMsg.data() + 1 + sizeof(Locations), &bs, 4);
-          for (int fd: updateChannels) {
-            my_write(fd, Update, updateMsg);
-          }
+          moveReplica(moves, k, locs, i, allocateDefault(k, this, 1).locs[0], false);
         }
       }
       
+      sendMigrations(moves);
       string tmp = string("Leave done in master ") + to_string(thisId);
       my_write(nameServer, Log, tmp);
     } else if (msgType == DumpKeys) {
@@ -680,10 +1197,10 @@ public:
       for (pair<const K, Locations> &pair:fallback) {
         const K &k = pair.first;
         auto &locs = pair.second.locs;
-        int i = 0;
-        while (locs[i].dId != sId && i < 3) ++i;
+        uint i = 0;
+        while (i < locationSlots && locs[i].dId != sId) ++i;
         
-        if (i == 3) continue;
+        if (i == locationSlots) continue;
         f << k << endl;
       }
       
@@ -694,10 +1211,10 @@ public:
           
           const K &k = b.keys[s];
           auto &locs = b.values[s].locs;
-          int i = 0;
-          while (locs[i].dId != sId && i < 3) ++i;
+          uint i = 0;
+          while (i < locationSlots && locs[i].dId != sId) ++i;
           
-          if (i == 3) continue;
+          if (i == locationSlots) continue;
           
           f << k << endl;
         }
@@ -714,49 +1231,29 @@ public:
       unordered_map <uint, Location> m;
       for (int i = 0; i < n; ++i) {
         uint32_t blkId = p[i];
+        if (segments[did].count(blkId)) continue;  // shared by many small objects, so left to compaction
         Location location = allocateDefault("1", this, 1).locs[0];  // just a random key is good
         m[blkId] = location;
       }
       
-      vector <u_char> updateMsg;
-      updateMsg.reserve(500);
+      // as with Leave, the keys switch over on Migrated
+      Migrations moves;
       
       mylock_guard g(updateLock);
       for (pair<const K, Locations> &pair:fallback) {
         const K &k = pair.first;
         auto &locs = pair.second.locs;
-        int i = 0;
-        while (i < 3) {
+        uint i = 0;
+        while (i < locationSlots) {
           if (locs[i].dId == did) {
             auto it = m.find(locs[i].blkId);
             if (it != m.end()) {
-              locs[i] = it->second;
+              moveReplica(moves, k, locs, i, it->second, true);
               break;
             }
           }
           ++i;
         }
-        
-        if (i == 3) continue;
-        
-        int j = (i + 1) % 3;
-        // copy to storage node: j to i
-        updateMsg.resize(12);
-        uint32_t *p = (uint32_t *) updateMsg.data();
-        p[0] = locs[j].blkId;
-        p[1] = locs[i].dId;
-        p[2] = locs[i].blkId;
-        my_write(storages[j].addrPort, Copy, updateMsg);
-        
-        // send the update to lookups
-        updateMsg.resize(1 + sizeof(Locations) + k.length() + 1);
-        
-        *updateMsg.data() = 1;
-        memcpy(updateMsg.data() + 1, &locs, sizeof(Locations));
-        memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
-        for (int fd: updateChannels) {
-          my_write(fd, Update, updateMsg);
-        }
       }
       
       for (uint64_t bid = 0; bid < ludo.num_buckets_; ++bid) {
@@ -766,46 +1263,24 @@ public:
           const K &k = b.keys[s];
           auto &locs = b.values[s].locs;
           
-          int i = 0;
-          while (i < 3) {
+          uint i = 0;
+          while (i < locationSlots) {
             if (locs[i].dId == did) {
               auto it = m.find(locs[i].blkId);
               if (it != m.end()) {
-                locs[i] = it->second;
+                moveReplica(moves, k, locs, i, it->second, true);
                 break;
               }
             }
             ++i;
           }
-          
-          if (i == 3) continue;
-          
-          int j = (i + 1) % 3;
-          // copy to storage node: j to i
-          updateMsg.resize(12);
-          uint32_t *p = (uint32_t *) updateMsg.data();
-          p[0] = locs[j].blkId;
-          p[1] = locs[i].dId;
-          p[2] = locs[i].blkId;
-          my_write(storages[j].addrPort, Copy, updateMsg);
-          
-          // send the update messages to lookups
-          updateMsg.resize(1 + 4 + sizeof(Locations));
-          
-          *updateMsg.data() = 0;
-          uint32_t bs = (bid << 2) + s;
-          memcpy(updateMsg.data() + 1, &locs, sizeof(Locations));
-          memcpy(updateMsg.data() + 1 + sizeof(Locations), &bs, 4);
-          for (int fd: updateChannels) {
-            my_write(fd, Update, updateMsg);
-          }
         }
       }
       
-      mylock_guard gg(loadLock);
-      for (int i = 0; i < n; ++i) {
-        uint blkId = p[i];
-        occupied[did][blkId / 256].memSet(blkId % 256, 0);
+      sendMigrations(moves);
+      for (auto &pair: m) {  // the hot blocks themselves are freed on Migrated, once nothing refers to them
+        const Location &to = pair.second;
+        if (to.dId != uint32_t(-1) && !relocations.count(uint64_t(to.dId) << 32 | to.blkId)) release(to.dId, to.blkId);
       }
     } else if (msgType == Size) {
       uint did = *(uint * )(msg.data());
@@ -813,8 +1288,8 @@ public:
       mylock_guard g(updateLock);
       for (pair<const K, Locations> &pair:fallback) {
         auto &locs = pair.second.locs;
-        int i = 0;
-        while (i < 3) {
+        uint i = 0;
+        while (i < locationSlots) {
           if (locs[i].dId == did) {
             size++;
           }
@@ -829,8 +1304,8 @@ public:
           const K &k = b.keys[s];
           auto &locs = b.values[s].locs;
           
-          int i = 0;
-          while (i < 3) {
+          uint i = 0;
+          while (i < locationSlots) {
             if (locs[i].dId == did) {
               size++;
             }
@@ -842,11 +1317,325 @@ public:
       string tmp = string("Size for storage ") + to_string(did) + ": " + to_string(size);
       //cout << "Size for storage: " << to_string(size) << endl;
       my_write(nameServer, Log, tmp);
+    } else if (msgType == Migrated) {
+      uint32_t *p = (uint32_t *) msg.data();
+      uint32_t moved = p[1], failed = p[2];
+      if (msg.size() < 24 + 16ULL * (moved + failed)) return true;
+      
+      {
+        vector <u_char> updateMsg;
+        uint64_t logged = 0;
+        const uint32_t *entry = p + 6;  // <sBlkId, sOffset, dSId, dBlkId>
+        
+        mylock_guard g(updateLock);
+        for (uint32_t i = 0; i < moved + failed; ++i, entry += 4) {
+          auto range = relocations.equal_range(uint64_t(entry[2]) << 32 | entry[3]);
+          for (auto it = range.first; it != range.second && i < moved; ++it) {
+            const Relocation &r = it->second;
+            uint64_t at = relocate(r, updateMsg);
+            if (!at) continue;
+            logged = max(logged, at);
+            if (r.release && allocated[r.old.dId].memGet(r.old.blkId / 256)) release(r.old.dId, r.old.blkId);
+          }
+          if (i >= moved && range.first != range.second) release(entry[2], entry[3]);  // the copy is given up
+          relocations.erase(range.first, range.second);
+        }
+        commitLog(logged);
+      }
+      
+      mylock_guard g(migrationLock);
+      MigrationProgress &progress = migrations[p[0]];
+      progress.moved += moved;
+      progress.failed += failed;
+      progress.bytes += *(uint64_t *) (p + 4);
+      if (p[3] == 0) {  // the storage has nothing left
+        string tmp = string("Migration from storage ") + to_string(p[0]) + " done: " + to_string(progress.moved) +
+                     " moved, " + to_string(progress.failed) + " failed, " + human(progress.bytes) + "B";
+        my_write(nameServer, Log, tmp);
+        migrations.erase(p[0]);
+      }
     } else return false;
     
     return true;
   }
   
+  // Leave/Hot moves, collected per source storage during the scan and sent as one Migrate each afterwards. the
+  // storages report back with Migrated, summed up here until a storage is done
+  typedef unordered_map<uint32_t, vector<uint32_t>> Migrations;  // source sId -> Migrate entries
+  
+  struct MigrationProgress {
+    uint64_t moved = 0, failed = 0, bytes = 0;
+  };
+  recursive_mutex migrationLock;
+  unordered_map<uint32_t, MigrationProgress> migrations;  // source sId -> progress so far
+  
+  // a replica of k being replaced with to. k keeps the old one, still served, until the copy is confirmed with
+  // Migrated. release: the old block is freed then and not before, as a stripe fragment is copied from it. a
+  // leaving storage keeps its blocks. under updateLock
+  struct Relocation {
+    K k;
+    Location old, to;
+    bool release;
+  };
+  unordered_multimap<uint64_t, Relocation> relocations;  // by destination, dId << 32 | blkId
+  
+  // replica i is to be replaced with to, copied from the next replica. a fragment of a stripe, or an object without
+  // another replica, is moved from where it is
+  void moveReplica(Migrations &moves, const K &k, const Location *locs, int i, Location to, bool release) {
+    Location next = locs[(i + 1) % 3];
+    Location from = locs[i].striped() || next.dId == uint32_t(-1) ? locs[i] : next;
+    if (locs[i].striped() && to.dId != uint32_t(-1)) to.offset = locs[i].offset;
+    if (!addMigration(moves, from, to)) return;
+    relocations.emplace(uint64_t(to.dId) << 32 | to.blkId, Relocation{k, locs[i], to, release});
+  }
+  
+  static bool addMigration(Migrations &moves, const Location &from, const Location &to) {
+    if (from.dId == uint32_t(-1) || to.dId == uint32_t(-1)) return false;  // no other replica to copy from, or no space
+    moves[from.dId].insert(moves[from.dId].end(), {from.blkId, from.offset, to.dId, to.blkId});
+    return true;
+  }
+  
+  // the copy is at r.to: k switches over to it, for the lookups, the log and the subscribers, unless the replica
+  // changed meanwhile. returns the log position, 0 if nothing was logged. under updateLock
+  uint64_t relocate(const Relocation &r, vector <u_char> &updateMsg) {
+    Locations locations;
+    auto it = fallback.find(r.k);
+    bool inFallback = it != fallback.end();
+    if (inFallback) locations = it->second;
+    else if (!ludo.lookUp(r.k, locations)) return 0;
+    
+    uint i = 0;
+    while (i < locationSlots && locations.locs[i] != r.old) ++i;
+    if (i == locationSlots) return 0;
+    locations.locs[i] = r.to;
+    
+    if (inFallback) it->second = locations;
+    return changeLocations(r.k, locations, inFallback, updateMsg);
+  }
+  
+  // k, found in the fallback or in ludo, is now at locations: for ludo, the lookups, the subscribers and the log.
+  // returns the log position. under updateLock
+  uint64_t changeLocations(const K &k, const Locations &locations, bool inFallback, vector <u_char> &updateMsg) {
+    if (inFallback) {
+      updateMsg.resize(1 + sizeof(Locations) + k.length() + 1);
+      *updateMsg.data() = 1;
+      memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
+      memcpy(updateMsg.data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
+    } else {
+      UpdateResult result = ludo.changeValue(k, locations);
+      uint32_t bs = (result.path[0].bid << 2) + result.path[0].sid;
+      updateMsg.resize(1 + sizeof(Locations) + 4);
+      *updateMsg.data() = 0;
+      memcpy(updateMsg.data() + 1, &locations, sizeof(Locations));
+      memcpy(updateMsg.data() + 1 + sizeof(Locations), &bs, 4);
+    }
+    publish(Update, updateMsg);
+    notifySubscribers(k, locations);
+    return appendLog(k, locations);
+  }
+  
+  void sendMigrations(const Migrations &moves) {
+    for (auto &pair: moves) {
+      vector<uint32_t> msg = {thisId, uint32_t(pair.second.size() / 4)};
+      msg.insert(msg.end(), pair.second.begin(), pair.second.end());
+      my_write(storages[pair.first].addrPort, Migrate, msg.data(), msg.size() * 4);
+    }
+  }
+  
+  // clients caching locations. they get <locations, k> on every relocation, and empty locations on removal. as on
+  // the update channels, the handlers only queue them and a sender thread per client writes them out. a client more
+  // than updateQueueLimit behind gets the empty key instead, which drops its whole cache
+  struct Subscriber {
+    string addrPort;
+    mutex lock;
+    condition_variable cv;
+    deque<shared_ptr<const vector<char>>> frames;
+    bool open = true;  // false: stopped, or the client is gone
+    thread sender;
+  };
+  recursive_mutex subscriberLock;
+  unordered_map<string, Subscriber *> subscribers;
+  
+  void addSubscriber(const string &addrPort) {
+    mylock_guard g(subscriberLock);
+    if (subscribers.count(addrPort)) return;
+    auto *subscriber = new Subscriber;
+    subscriber->addrPort = addrPort;
+    subscriber->sender = thread(&Master::sendInvalidations, this, subscriber);
+    subscribers[addrPort] = subscriber;
+  }
+  
+  void dropSubscriber(Subscriber *subscriber) {
+    {
+      lock_guard<mutex> gs(subscriber->lock);
+      subscriber->open = false;
+    }
+    subscriber->cv.notify_one();
+    subscriber->sender.join();
+    delete subscriber;
+  }
+  
+  void notifySubscribers(const K &k, const Locations &locations) {
+    mylock_guard g(subscriberLock);
+    if (subscribers.empty()) return;
+    
+    auto msg = make_shared<vector<char>>(sizeof(Locations) + k.length() + 1);
+    memcpy(msg->data(), &locations, sizeof(Locations));
+    memcpy(msg->data() + sizeof(Locations), k.data(), k.length() + 1);
+    
+    for (auto it = subscribers.begin(); it != subscribers.end();) {
+      Subscriber *subscriber = it->second;
+      {
+        lock_guard<mutex> gs(subscriber->lock);
+        if (subscriber->open) {
+          if (subscriber->frames.size() >= updateQueueLimit) {
+            subscriber->frames.clear();
+            subscriber->frames.push_back(make_shared<vector<char>>(sizeof(Locations) + 1));  // empty locations, key ""
+          } else {
+            subscriber->frames.push_back(msg);
+          }
+          subscriber->cv.notify_one();
+          ++it;
+          continue;
+        }
+      }
+      dropSubscriber(subscriber);  // the client is gone
+      it = subscribers.erase(it);
+    }
+  }
+  
+  void sendInvalidations(Subscriber *subscriber) {
+    prctl(PR_SET_NAME, (name + " invalidations").c_str(), 0, 0, 0);
+    
+    unique_lock<mutex> g(subscriber->lock);
+    while (true) {
+      subscriber->cv.wait(g, [subscriber] { return !subscriber->frames.empty() || !subscriber->open; });
+      if (!subscriber->open) return;
+      
+      auto msg = move(subscriber->frames.front());
+      subscriber->frames.pop_front();
+      g.unlock();
+      
+      int fd = acquireConnection(subscriber->addrPort, false, true);
+      bool sent = fd >= 0 && my_write(fd, Update, *msg) == 0;
+      if (sent) releaseConnection(subscriber->addrPort, fd, true);
+      else if (fd >= 0) close(fd);
+      
+      g.lock();
+      if (!sent) {  // dropped on the next notification
+        subscriber->open = false;
+        return;
+      }
+    }
+  }
+  
+  // a client keeping its own copy of this shard's Ludo DP. it rides on updateChannels like a lookup node, and starts
+  // with a resync, which sends it the current snapshot and fallback entries
+  void addReplica(const string &addrPort) {
+    int fd = connectToServer(addrPort, false);
+    if (fd < 0) return;
+    
+    mylock_guard g(updateLock);
+    mylock_guard gg(sendLock);
+    my_write(fd, SubscribeLudo, &thisId, 4);  // lets the client tell this stream from other frames
+    
+    UpdateChannel *channel = addChannel(fd);
+    lock_guard<mutex> gc(channel->lock);
+    channel->resync = true;
+  }
+  
+  // under updateLock and sendLock, or before the channels are in use
+  UpdateChannel *addChannel(int fd) {
+    auto *channel = new UpdateChannel;
+    channel->fd = fd;
+    channel->sender = thread(&Master::sendUpdates, this, channel);
+    updateChannels.push_back(channel);
+    return channel;
+  }
+  
+  // queues an update to every subscriber without waiting for it. the caller holds updateLock or sendLock, from the
+  // change to here, which keeps the frames in the order of the changes
+  void publish(uint32_t type, const void *data, uint32_t length) {
+    auto body = make_shared<const vector<char>>((const char *) data, (const char *) data + length);
+    for (UpdateChannel *channel: updateChannels) {
+      {
+        lock_guard<mutex> g(channel->lock);
+        ++channel->seq;
+        if (channel->resync) continue;  // the coming resync carries this change
+        
+        if (channel->frames.size() >= updateQueueLimit) {
+          channel->frames.clear();
+          channel->resync = true;
+        } else {
+          channel->frames.push_back({channel->seq, type, body});
+        }
+      }
+      channel->cv.notify_one();
+    }
+  }
+  
+  void publish(uint32_t type, const vector <u_char> &data) {
+    publish(type, data.data(), data.size());
+  }
+  
+  void publish(uint32_t type, const string &data) {
+    publish(type, data.data(), data.length() + 1);
+  }
+  
+  void sendUpdates(UpdateChannel *channel) {
+    prctl(PR_SET_NAME, (name + " updates").c_str(), 0, 0, 0);
+    
+    unique_lock<mutex> g(channel->lock);
+    while (true) {
+      channel->cv.wait(g, [channel] { return !channel->frames.empty() || channel->resync || !channel->open; });
+      if (!channel->open) return;
+      
+      if (channel->resync) {
+        g.unlock();
+        resync(channel);
+        g.lock();
+        continue;
+      }
+      
+      UpdateFrame frame = move(channel->frames.front());
+      channel->frames.pop_front();
+      g.unlock();
+      
+      // <seq(u64), type(u32)>, then the body of that type
+      uint32_t header[3];
+      memcpy(header, &frame.seq, 8);
+      header[2] = frame.type;
+      iovec parts[2] = {{header, sizeof(header)}, {(void *) frame.body->data(), frame.body->size()}};
+      my_writev(channel->fd, Sequenced, parts, 2);
+      
+      g.lock();
+    }
+  }
+  
+  // replaces what the channel has queued with the whole state: UpdateLudo, then the fallback entries as mode 1
+  // Inserts (the replica drops its own on UpdateLudo). both locks are held, so no change is made in between
+  void resync(UpdateChannel *channel) {
+    mylock_guard g(updateLock);
+    vector <u_char> updateMsg = serializeLudo(true);
+    mylock_guard gg(sendLock);
+    
+    lock_guard<mutex> gc(channel->lock);
+    channel->frames.clear();
+    channel->resync = false;
+    channel->frames.push_back({++channel->seq, UpdateLudo,
+                               make_shared<const vector<char>>(updateMsg.begin(), updateMsg.end())});
+    
+    for (pair<const K, Locations> &pair:fallback) {
+      const K &k = pair.first;
+      auto body = make_shared<vector<char>>(1 + sizeof(Locations) + k.length() + 1);
+      *body->data() = 1;
+      memcpy(body->data() + 1, &pair.second, sizeof(Locations));
+      memcpy(body->data() + 1 + sizeof(Locations), k.data(), k.length() + 1);
+      channel->frames.push_back({++channel->seq, Insert, body});
+    }
+    channel->cv.notify_one();
+  }
+  
   bool locate(const K &k, Locations &out) {
     return ludo.lookUp(k, out);
   }
@@ -859,7 +1648,7 @@ public:
   
   void occupy(uint dId, uint blkId, bool inHeap = true) {
     mylock_guard g(loadLock);
-    occupied[dId][blkId / 256].memSet(blkId % 256U, 1);
+    freeBlocks[dId].set(blkId, false);
     loadInfo[dId].first++;
     
     if (inHeap) leastLoaded.decrease(dId);
@@ -867,11 +1656,255 @@ public:
   
   void release(uint dId, uint blkId, bool inHeap = true) {
     mylock_guard g(loadLock);
-    occupied[dId][blkId / 256].memSet(blkId % 256U, 0);
+    freeBlocks[dId].set(blkId, true);
     loadInfo[dId].first--;
     
     if (inHeap) leastLoaded.increase(dId);
   }
+  
+  // first free block of the disk from the last available bulk on, occupied. -1 if the disk is full
+  uint allocateBlock(uint dId, bool inHeap = true) {
+    mylock_guard g(loadLock);
+    if (loadInfo[dId].first >= loadInfo[dId].second) return -1;
+    
+    uint64_t blkId = freeBlocks[dId].next(lastAvailable[dId] * 256ULL);
+    if (blkId == uint64_t(-1)) blkId = freeBlocks[dId].next(0);
+    if (blkId == uint64_t(-1)) return -1;
+    
+    lastAvailable[dId] = blkId / 256;
+    occupy(dId, blkId, inHeap);
+    return blkId;
+  }
+  
+  // turns the locations allocated for an object into a stripe of its fragments. they are on locationSlots different
+  // disks, as allocate gives them. if fewer were found, the object stays replicated
+  static void stripe(Locations &locations, uint32_t size) {
+    for (auto &location: locations.locs) {
+      if (location.dId == uint32_t(-1)) return;
+    }
+    for (auto &location: locations.locs) location.offset = Location::Striped | size;
+  }
+  
+  // the same disks as allocateDefault, but an extent in each one's open segment
+  Locations allocatePacked(uint32_t size) {
+    mylock_guard g(loadLock);
+    
+    Locations locations;
+    
+    for (int i = 0; i < 3; ++i) {
+      if (leastLoaded.empty()) break;
+      uint dId = leastLoaded.top();
+      
+      if (!storages[dId].in) continue;
+      leastLoaded.pop();
+      
+      locations.locs[i] = packedLocation(dId, size, false);
+      if (locations.locs[i].dId == uint32_t(-1)) {
+        leastLoaded.push(dId);
+        break;
+      }
+    }
+    
+    for (int i = 0; i < 3; ++i) {
+      uint32_t id = locations.locs[i].dId;
+      if (id == uint32_t(-1)) break;
+      leastLoaded.push(id);
+    }
+    
+    return locations;
+  }
+  
+  // appends an extent to the open segment of the disk. when it does not fit, the segment is sealed and a new one opened
+  Location packedLocation(uint dId, uint32_t size, bool inHeap = true) {
+    mylock_guard g(loadLock);
+    uint32_t extent = packedExtent(size);
+    uint32_t &open = openSegments[dId];
+    
+    if (open != uint32_t(-1) && segments[dId][open].fill + extent > blockSize) {
+      uint32_t sealed = open;
+      open = -1;
+      checkSegment(dId, sealed, inHeap);
+    }
+    if (open == uint32_t(-1)) {
+      open = allocateBlock(dId, inHeap);
+      if (open == uint32_t(-1)) return Location();
+    }
+    
+    Segment &segment = segments[dId][open];
+    Location location = {dId, open, Location::Packed | segment.fill};
+    segment.extents[segment.fill] = extent;
+    segment.fill += extent;
+    segment.live += extent;
+    return location;
+  }
+  
+  void releasePacked(const Location &location) {
+    mylock_guard g(loadLock);
+    auto it = segments[location.dId].find(location.blkId);
+    if (it == segments[location.dId].end()) return;
+    
+    Segment &segment = it->second;
+    auto extent = segment.extents.find(location.byteOffset());
+    if (extent == segment.extents.end()) return;
+    
+    segment.live -= extent->second;
+    segment.extents.erase(extent);
+    segment.keys.erase(location.byteOffset());
+    checkSegment(location.dId, location.blkId);
+  }
+  
+  // k is the key of its packed objects, for compaction to find
+  void ownPacked(const K &k, const Locations &locations) {
+    mylock_guard g(loadLock);
+    for (auto &location: locations.locs) {
+      if (location.dId >= nStorages || !location.packed()) continue;
+      auto it = segments[location.dId].find(location.blkId);
+      if (it != segments[location.dId].end()) it->second.keys[location.byteOffset()] = k;
+    }
+  }
+  
+  // a sealed segment is freed once empty, and queued for compaction once mostly dead
+  void checkSegment(uint32_t dId, uint32_t blkId, bool inHeap = true) {
+    mylock_guard g(loadLock);
+    auto it = segments[dId].find(blkId);
+    if (it == segments[dId].end() || blkId == openSegments[dId] || compactingSegment == make_pair(dId, blkId)) return;
+    
+    if (!it->second.live) {
+      segments[dId].erase(it);
+      sparseSegments.erase({dId, blkId});
+      release(dId, blkId, inHeap);
+    } else if (it->second.live < it->second.fill * compactRatio) {
+      sparseSegments.insert({dId, blkId});
+      if (!compacting) {
+        compacting = true;
+        thread(&Master::compactSegments, this).detach();
+      }
+    }
+  }
+  
+  void compactSegments() {
+    prctl(PR_SET_NAME, (name + " compact").c_str(), 0, 0, 0);
+    while (alive) {
+      pair<uint32_t, uint32_t> segment;
+      {
+        mylock_guard g(loadLock);
+        if (sparseSegments.empty()) {
+          compacting = false;
+          return;
+        }
+        segment = *sparseSegments.begin();
+        sparseSegments.erase(sparseSegments.begin());
+      }
+      compact(segment.first, segment.second);
+    }
+  }
+  
+  // moves the live objects of a segment to the open segment of the same disk. the storage copies them without
+  // updateLock held, and tags each source so that an in-place Update racing the copy fails instead of being lost (the
+  // client inserts it anew). then the keys still at the sources are pointed to the copies, and the storage drops the
+  // sources before their extents are given back
+  void compact(uint32_t dId, uint32_t blkId) {
+    unordered_map<uint32_t, Location> moved;  // old Location::offset -> new location
+    vector<uint32_t> moves = {0};             // <n, (source blkId, source offset, dest blkId, dest offset) * n>
+    {
+      mylock_guard gl(loadLock);
+      auto it = segments[dId].find(blkId);
+      if (it == segments[dId].end() || blkId == openSegments[dId]) return;
+      
+      for (auto &extent: it->second.extents) {
+        Location to = packedLocation(dId, extent.second);
+        if (to.dId == uint32_t(-1)) break;  // the disk is full. the objects moved so far still make room
+        
+        moved[Location::Packed | extent.first] = to;
+        moves.insert(moves.end(), {blkId, Location::Packed | extent.first, to.blkId, to.offset});
+      }
+      if (moved.empty()) return;
+      compactingSegment = {dId, blkId};
+    }
+    moves[0] = moved.size();
+    
+    vector<char> reply = call(storages[dId].addrPort, Compact, moves.data(), moves.size() * 4, compactTimeoutMs).get();
+    if (reply.empty() || !reply[0]) {
+      // the keys stay where they are. the copies are given back unless the storage timed out and may still write them
+      if (!reply.empty()) for (auto &pair: moved) releasePacked(pair.second);
+      
+      mylock_guard gl(loadLock);
+      compactingSegment = {-1, -1};
+      auto it = segments[dId].find(blkId);
+      if (it != segments[dId].end() && !it->second.live) checkSegment(dId, blkId);  // not queued again right away
+      return;
+    }
+    
+    unordered_set<uint32_t> relocated;  // the old Location::offset of the objects a key was pointed away from
+    {
+      mylock_guard g(updateLock);
+      relocateAll(dId, blkId, moved, relocated);
+    }
+    
+    // the sources a key left and the copies none took are dropped at the storage, and only then given back
+    vector<pair<Location, future<vector<char>>>> drops;
+    for (auto &pair: moved) {
+      Locations dropped;
+      dropped.locs[0] = relocated.count(pair.first) ? Location{dId, blkId, pair.first} : pair.second;
+      drops.emplace_back(dropped.locs[0], call(storages[dId].addrPort, Remove, &dropped, sizeof(Locations), compactTimeoutMs));
+    }
+    for (auto &drop: drops) {
+      vector<char> dropReply = drop.second.get();
+      if (!dropReply.empty() && dropReply[0]) releasePacked(drop.first);
+    }
+    
+    mylock_guard gl(loadLock);
+    compactingSegment = {-1, -1};
+    checkSegment(dId, blkId);
+  }
+  
+  // points the keys at the moved objects of a segment to their copies. the keys are the segment's own, so this is
+  // the work of the moved objects only. under updateLock
+  void relocateAll(uint32_t dId, uint32_t blkId, const unordered_map<uint32_t, Location> &moved,
+                   unordered_set<uint32_t> &relocated) {
+    vector <K> keys;
+    {
+      mylock_guard gl(loadLock);
+      auto it = segments[dId].find(blkId);
+      if (it == segments[dId].end()) return;
+      for (auto &pair: moved) {
+        auto key = it->second.keys.find(Location::byteOffset(pair.first));
+        if (key != it->second.keys.end()) keys.push_back(key->second);
+      }
+    }
+    
+    vector <u_char> updateMsg;
+    uint64_t logged = 0;
+    mylock_guard gg(sendLock);
+    for (const K &k: keys) {
+      Locations locations;
+      auto it = fallback.find(k);
+      bool inFallback = it != fallback.end();
+      if (inFallback) locations = it->second;
+      else if (!ludo.lookUp(k, locations)) continue;
+      if (!relocate(locations, dId, blkId, moved, relocated)) continue;
+      
+      if (inFallback) it->second = locations;
+      ownPacked(k, locations);
+      logged = changeLocations(k, locations, inFallback, updateMsg);
+    }
+    
+    commitLog(logged);
+  }
+  
+  static bool relocate(Locations &locations, uint32_t dId, uint32_t blkId, const unordered_map<uint32_t, Location> &moved,
+                       unordered_set<uint32_t> &relocated) {
+    for (Location &location: locations.locs) {
+      if (location.dId != dId || location.blkId != blkId || !location.packed()) continue;
+      
+      auto it = moved.find(location.offset);
+      if (it == moved.end()) return false;
+      relocated.insert(location.offset);
+      location = it->second;
+      return true;
+    }
+    return false;
+  }
 };
 
 // first available block on the least loaded disk. RESERVE before sending!
@@ -881,6 +1914,7 @@ inline Locations allocateDefault(const K &k, Master *_this, uint8_t count) {
   Locations locations;
   
   for (int i = 0; i < count; ++i) {
+    if (_this->leastLoaded.empty()) break;  // fewer disks than slots
     uint dId = _this->leastLoaded.top();
     pair <uint, uint> &load = _this->loadInfo[dId];
     
@@ -888,25 +1922,8 @@ inline Locations allocateDefault(const K &k, Master *_this, uint8_t count) {
     if (load.first >= load.second) break;
     _this->leastLoaded.pop();
     
-    uint start = _this->lastAvailable[dId];
-    
-    uint64_t bitsCnt = _this->allocated[dId].capacity;
-    for (uint cnt = 0; cnt < bitsCnt; ++cnt) {
-      uint bulkId = cnt + start;
-      if (bulkId > bitsCnt) bulkId -= bitsCnt;
-      
-      if (!_this->allocated[dId].memGet(bulkId)) continue;
-      
-      uint blkId = _this->bulkFreeIndex(dId, bulkId);
-      if (blkId != uint(-1)) {
-        _this->lastAvailable[dId] = bulkId;
-        
-        blkId = bulkId * 256U + uint32_t(blkId);
-        _this->occupy(dId, blkId, false);
-        locations.locs[i] = {dId, blkId};
-        break;
-      }
-    }
+    uint blkId = _this->allocateBlock(dId, false);
+    if (blkId != uint(-1)) locations.locs[i] = {dId, blkId};
   }
   
   for (int i = 0; i < count; ++i) {
@@ -125,9 +125,9 @@ public:
   }
   
   void inform(const string &node) {
-    int fd = connectToServer(node);
+    int fd = acquireConnection(node, true, true);
     inform(fd);
-    close(fd);
+    releaseConnection(node, fd, true);
   }
   
   vector<vector<uint8_t>> allocated;   // [disk #] [bulk #] -> value: master #
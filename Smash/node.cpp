@@ -39,6 +39,15 @@ const char *_MessageTypeNames[] = {
     "Size",
     "DumpKeys",
     "Log",
+    "Subscribe",
+    "SubscribeLudo",
+    "MultiLocate",
+    "MultiRead",
+    "Compact",
+    "Migrate",
+    "Migrated",
+    "MultiInsert",
+    "Sequenced",
     "ReadReply"
 };
 const char**MessageTypeNames = _MessageTypeNames;
@@ -70,7 +79,7 @@ const char**MessageTypeNames = _MessageTypeNames;
 }
 
 [[noreturn]] int storage_main(int argc, char **argv) {
-  Storage node(atoi(argv[2]), argv[3]);
+  Storage node(atoi(argv[2]), vector<string>(argv + 3, argv + argc));  // <blocks per device> <device>...
   node.sendRegisterMsg();
   
   while (true) {
@@ -26,11 +26,71 @@ struct StorageNodeInfo {
   uint32_t capacity; // unit: 4MB block
 };
 
+// objects up to Node::packLimit share segment blocks, appended one after another. such a location is tagged with
+// Packed and carries the byte offset inside the block. 0 means the object has the whole block to itself
+const uint packAlign = 512;
+
+inline uint32_t packedExtent(uint32_t size) {  // the space a packed object of this size takes in its segment
+  return (max(size, 1U) + packAlign - 1) / packAlign * packAlign;
+}
+
+// an erasure-coded object is a stripe over ecData + ecParity locations: ecData data fragments, then ecParity parity
+// ones, each a whole block on its own disk. its locations are tagged with Striped and carry the object size instead of
+// an offset. it survives the loss of any ecParity disks. striping is built in on demand (-DSMASH_EC, 2+2 unless set
+// with -DSMASH_EC_DATA=4 -DSMASH_EC_PARITY=2), as every key then carries that many location slots. without it, every
+// object is replicated, and a key carries the three slots of its replicas
+#if defined(SMASH_EC) || defined(SMASH_EC_DATA) || defined(SMASH_EC_PARITY)
+const bool striping = true;
+#else
+const bool striping = false;
+#endif
+#ifndef SMASH_EC_DATA
+#define SMASH_EC_DATA 2
+#endif
+#ifndef SMASH_EC_PARITY
+#define SMASH_EC_PARITY 2
+#endif
+const uint ecData = SMASH_EC_DATA, ecParity = SMASH_EC_PARITY;
+const uint locationSlots = striping ? ecData + ecParity : 3;
+static_assert(ecData >= 1 && ecData + ecParity >= 3, "a stripe takes at least the three slots of a replicated object");
+
+inline uint32_t fragmentSize(uint32_t size) {  // of each fragment of a stripe. the last data one may be shorter
+  return (size + ecData - 1) / ecData;
+}
+
 struct Location {
-  uint32_t dId = -1, blkId = 0;
+  static const uint32_t Packed = 0x80000000U;
+  static const uint32_t Striped = 0x40000000U;
+  
+  uint32_t dId = -1, blkId = 0, offset = 0;
+  
+  bool packed() const {
+    return offset & Packed;
+  }
+  
+  static bool striped(uint32_t offset) {
+    return (offset & (Packed | Striped)) == Striped;
+  }
+  
+  bool striped() const {
+    return striped(offset);
+  }
+  
+  uint32_t stripedSize() const {
+    return offset & ~Striped;
+  }
+  
+  // where the object starts in its block
+  static uint32_t byteOffset(uint32_t offset) {
+    return offset & Packed ? offset & ~Packed : 0;
+  }
+  
+  uint32_t byteOffset() const {
+    return byteOffset(offset);
+  }
   
   bool operator==(const Location &other) const {
-    return dId == other.dId && blkId == other.blkId;
+    return dId == other.dId && blkId == other.blkId && offset == other.offset;
   }
   
   bool operator!=(const Location &other) const {
@@ -39,10 +99,13 @@ struct Location {
 };
 
 struct Locations {
-  Location locs[3];   // TODO the number "3" is compile-time constant. So nReplicas should be 3
+  Location locs[locationSlots];   // replicas in the first nReplicas, always 3. a stripe takes them all
   
   bool operator==(const Locations &other) const {
-    return locs[0] == other.locs[0] && locs[1] == other.locs[1] && locs[2] == other.locs[2];
+    for (uint i = 0; i < locationSlots; ++i) {
+      if (locs[i] != other.locs[i]) return false;
+    }
+    return true;
   }
   
   bool operator!=(const Locations &other) const {
@@ -50,6 +113,38 @@ struct Locations {
   }
 };
 
+// the key list of MultiLocate/MultiRead: <n, (key\0) * n>
+inline void appendKeys(vector<char> &msg, const vector<K> &keys) {
+  uint64_t off = msg.size();
+  uint64_t size = off + 4;
+  for (const K &k: keys) size += k.length() + 1;
+  
+  msg.resize(size);
+  *(uint32_t *) (msg.data() + off) = keys.size();
+  off += 4;
+  for (const K &k: keys) {
+    memcpy(msg.data() + off, k.data(), k.length() + 1);
+    off += k.length() + 1;
+  }
+}
+
+// the key list from p up to end. false if it is malformed: n keys do not fit, or bytes are left over
+inline bool parseKeys(const char *p, const char *end, vector<K> &keys) {
+  if (end - p < 4) return false;
+  uint32_t n = *(uint32_t *) p;
+  p += 4;
+  
+  keys.clear();
+  keys.reserve(min<size_t>(n, end - p));  // each key takes a byte at least
+  for (uint32_t i = 0; i < n; ++i) {
+    const char *terminator = (const char *) memchr(p, 0, end - p);
+    if (!terminator) return false;
+    keys.emplace_back(p, terminator - p);
+    p = terminator + 1;
+  }
+  return p == end;
+}
+
 class Node : public SocketNode {
 public:
   int my_write(const string &addrPort, uint type, const vector<char> &data) {
@@ -85,6 +180,37 @@ public:
     return SocketNode::my_write(fd, type, thisId, data, length);
   }
   
+  int my_sendfile(const string &addrPort, uint32_t type, int fileFd, uint64_t offset, uint32_t length,
+                  const void *prefix = nullptr, uint32_t prefixLength = 0, const void *suffix = nullptr, uint32_t suffixLength = 0) {
+    return SocketNode::my_sendfile(addrPort, type, thisId, fileFd, offset, length, prefix, prefixLength, suffix, suffixLength);
+  }
+  
+  int my_sendfile(int fd, uint32_t type, int fileFd, uint64_t offset, uint32_t length,
+                  const void *prefix = nullptr, uint32_t prefixLength = 0, const void *suffix = nullptr, uint32_t suffixLength = 0) {
+    return SocketNode::my_sendfile(fd, type, thisId, fileFd, offset, length, prefix, prefixLength, suffix, suffixLength);
+  }
+  
+  int my_writev(const string &addrPort, uint32_t type, const iovec *parts, int nParts) {
+    return SocketNode::my_writev(addrPort, type, thisId, parts, nParts);
+  }
+  
+  int my_writev(int fd, uint32_t type, const iovec *parts, int nParts) {
+    return SocketNode::my_writev(fd, type, thisId, parts, nParts);
+  }
+  
+  future<vector<char>> call(const string &addrPort, uint32_t type, const void *data, uint32_t length, uint timeoutMs = 0) {
+    return SocketNode::call(addrPort, type, thisId, data, length, timeoutMs);
+  }
+  
+  future<vector<char>> call(const string &addrPort, uint32_t type, const string &data, uint timeoutMs = 0) {
+    return SocketNode::call(addrPort, type, thisId, data.data(), data.length() + 1, timeoutMs);
+  }
+  
+  void callAsync(const string &addrPort, uint32_t type, const iovec *parts, int nParts,
+                 function<void(vector<char> &&)> done, uint timeoutMs = 0) {
+    SocketNode::callAsync(addrPort, type, thisId, parts, nParts, move(done), timeoutMs);
+  }
+  
   uint nShards = -1;
   uint nReplicas = -1;
   
@@ -97,6 +223,19 @@ public:
   
   string nameServer;
   
+  // objects of up to packLimit bytes share segment blocks (see Master::allocatePacked). 0: off. the Ludo tables of
+  // the shards are then sized for packedPerBlock keys per block instead of one
+  inline static uint32_t packLimit = 0;
+  inline static uint32_t packedPerBlock = 16;
+  
+  uint32_t shardCapacity() const {
+    uint64_t sumCap = 0;
+    for (auto &info: storages) {
+      sumCap += info.capacity;
+    }
+    return sumCap * (packLimit ? packedPerBlock : 1) / nShards;
+  }
+  
   virtual int thisType() { return -1; }
   
   inline Node(string name, uint16_t port = 0) : SocketNode(name, port) {
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <future>
+#include <atomic>
+#include <condition_variable>
 #include "common.h"
 #include "node.h"
 
@@ -30,13 +37,15 @@ enum MessageTypes {
   Borrow,   // name server √√ to master √√         || format: <busyMasterId, dId, nBulks> // 9
   Granted,  // master √√ to master √√ / name server √√  || format: <busyMasterId, dId, bitmap>   // 10
   
-  // client √√ to master √√    || forth: <k(string)>   back: <*nReplica* locations>
+  // client √√ to master √√    || forth: <k(string), [size(u32), [striped(u8)]]>   back: <*nReplica* locations>.
+  // size: up to packLimit is packed. striped: erasure-coded, the client writes one fragment to each location
   // master √√ to lookup √√
-  // client √√ to storage √√  || forth: <*nReplica* locations, content of 4MB>  back: <true/false>
+  // client √√ to storage √√  || forth: <*nReplica* locations, object of up to 4MB>  back: <true/false>
   Insert,                                                                         // 11
   Remove,   // client √√  to master √√   //  [[[unnecessary]]] master to lookup   // 12
-  Copy,     // any √ to storage √  || format: source blkId, dest sId, dest blkId   // 13
-  Move,     // any √ to storage √  || format: source blkId, dest sId, dest blkId   // 14
+  // master √√ to storage √√ || format: <*nReplica* locations>, only for packed objects, to drop them from the segment index
+  Copy,     // any √ to storage √  || format: source blkId, dest sId, dest blkId, [source offset]   // 13
+  Move,     // any √ to storage √  || format: source blkId, dest sId, dest blkId, [source offset]   // 14
   // master invoke/receive the data movement, and the location is updated in ludo.
   // master send the update message to the lookup
   Update,   // master √ to lookup √  || format: mode (ludo or fallback), locations, key/<bid, sid>   // 15
@@ -45,8 +54,10 @@ enum MessageTypes {
   UpdateLudo,   // master  √√ to lookup  √√                // 17
   Return,  // general packet for returning some data back to the caller   // 18
   
-  // client √√ to lookup √√   || format: <seq(u32), port(u32), k(string)>
-  // lookup √√ to storage √√  || format: <seq(u32), blkId (u32), client_addr(string)>
+  // client √√ to lookup √√   || format: <seq(u32), port(u32), offset(u32), length(u32), k(string)>
+  // lookup √√ to storage √√  || format: <seq(u32), blkId (u32), blkOffset(u32), offset(u32), length(u32), client_addr(string)>
+  // blkOffset: Location::offset, where a packed object starts in its segment
+  // length -1: to the end of the object
   Read,   // 19
   Locate, // 20  client √√ to lookup √√ || forth: <k(string)>    back: <*nReplica* locations>
   
@@ -60,7 +71,26 @@ enum MessageTypes {
   DumpKeys, // any to master. format: dId  // 24
   Log, // any to name server. format: string.  // 25
   
-  ReadReply // storage √√ to client √√     || format: <seq as type, block 4MiB>   // 26
+  Subscribe, // client √√ to master √√ | format: <port(u16)>. the master then pushes Update <locations, k> on relocation/removal // 26
+  SubscribeLudo, // client √√ to master √√ | format: <port(u16)>. the master connects back, sends this with <shard(u32)>
+  // as the stream's first frame, then UpdateLudo and the fallback entries, and then the same updates as the lookups  // 27
+  MultiLocate, // client √√ to lookup √√ | format: <n, (key\0) * n>. returns <Locations * n>  // 28
+  MultiRead, // client √√ to lookup √√ | format: <seq, port, n, (key\0) * n>
+  // lookup/client √√ to storage √√ | format: <seq, n, (index, blkId, blkOffset) * n, client addr\0>
+  // storage/lookup √√ to client √√ | format: <seq as type, n, (index, length, object) * n>. length -1: not found  // 29
+  Compact, // master √√ to storage √√ | format: <n, (source blkId, source offset, dest blkId, dest offset) * n>. back: <true/false>
+  // moves the live packed objects of a segment on the same node  // 30
+  Migrate, // master √√ to storage √√ | format: <masterId, n, (source blkId, source offset, dest sId, dest blkId) * n>
+  // queued; the storage streams the objects to their destinations in the background  // 31
+  Migrated, // storage √√ to master √√ | format: <sId, moved, failed, left (u32), bytes (u64)>. progress of Migrate  // 32
+  // client √√ to master √√ | forth: <n, (k(string), size(u32), striped(u8)) * n>   back: <Locations * n>
+  // master √√ to lookup √√ | format: <n, (length(u32), Insert message) * n>, of the new keys
+  MultiInsert,  // 33
+  Sequenced, // master √√ to lookup √√ / client √√ | format: <seq(u64), type(u32), body of that type>. the update stream,
+  // numbered per subscriber  // 34
+  
+  ReadReply // storage √√ to client √√     || format: <seq as type, bytes, ok(u8)>. a failed read is just <0>   // 35
+  // <2>: the object is erasure-coded. the client reads its fragments
 };
 
 class SocketNode {
@@ -113,7 +143,9 @@ public:
       error("listen failed");
     }
     
-    listeningThread = thread([this, address, addrlen]() {
+    if (reactorWorkers) startReactor();
+    
+    listeningThread = thread([this]() {
       prctl(PR_SET_NAME, (name + " server").c_str(), 0, 0, 0);
       
       int new_socket;
@@ -123,6 +155,13 @@ public:
         if ((new_socket = accept(server_fd, (struct sockaddr *) &clientAddr, &addrlen)) < 0) {
           error("accept failed");
         }
+        int one = 1;
+        setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        if (reactorWorkers) {
+          addToReactor(new_socket, clientAddr);
+          continue;
+        }
         
         auto serveThread = thread([this, new_socket, clientAddr]() {
           lock.lock();  // inet_ntoa is thread unsafe
@@ -136,7 +175,7 @@ public:
           
           while (true) {
             auto tuple = my_read(new_socket);
-            int type = get<0>(tuple);
+            uint type = get<0>(tuple);
             int id = get<1>(tuple);
             vector<char> wholeMessage = get<2>(tuple);
 
@@ -145,7 +184,7 @@ public:
             
             if (wholeMessage.empty()) break;
             
-            onMessage(type, id, new_socket, addr, wholeMessage);
+            dispatch(type, id, new_socket, addr, wholeMessage);
           }
           
           close(new_socket);
@@ -160,11 +199,325 @@ public:
     return port;
   }
   
-  int connectToServer(string host) {
+  // epoll reactor: a fixed pool of workers instead of one thread per accepted connection.
+  // each connection is armed with EPOLLONESHOT, so at most one worker reads it at a time and the
+  // frames of a connection are still handled in order (the lookups rely on this for ludo updates).
+  // 0 falls back to the detached thread per connection
+  inline static uint reactorWorkers = max(16U, 4 * thread::hardware_concurrency());
+  
+  int epoll_fd = -1;
+  vector<thread> workers;
+  
+  struct Connection {
+    int fd;
+    string addr;
+    atomic<int> refs{1};  // the reactor's, plus one per call still being served after an early re-arm
+  };
+  
+  void unref(Connection *conn) {
+    if (--conn->refs) return;
+    close(conn->fd);
+    delete conn;
+  }
+  
+  void rearm(Connection *conn) {
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  }
+  
+  void startReactor() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      error("epoll_create1 failed");
+    }
+    
+    for (uint i = 0; i < reactorWorkers; ++i) {
+      workers.emplace_back([this]() {
+        prctl(PR_SET_NAME, (name + " worker").c_str(), 0, 0, 0);
+        
+        while (true) {
+          epoll_event event;
+          int n = epoll_wait(epoll_fd, &event, 1, -1);  // take one at a time so a slow handler does not hold other ready connections
+          if (n < 0 && errno == EINTR) continue;
+          if (n < 0) error("epoll_wait failed");
+          
+          auto *conn = (Connection *) event.data.ptr;
+          if (!serveOne(conn)) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+            unref(conn);
+          }
+        }
+      });
+      workers.back().detach();
+    }
+  }
+  
+  void addToReactor(int fd, const sockaddr_in &clientAddr) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &clientAddr.sin_addr, addr, sizeof(addr));
+    
+    auto *conn = new Connection{fd, addr};
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      delete conn;
+    }
+  }
+  
+  // the socket stays blocking: a readable socket holds the start of a frame, and the sender writes whole frames,
+  // so reading the rest of the 12-byte header and the body here does not stall the worker for long
+  bool serveOne(Connection *conn) {
+    auto tuple = my_read(conn->fd);
+    uint type = get<0>(tuple);
+    int id = get<1>(tuple);
+    vector<char> wholeMessage = get<2>(tuple);
+    
+    if (wholeMessage.empty()) return false;
+    
+    if (type & RpcTag) {  // calls are independent: other workers may take the next frames meanwhile
+      conn->refs++;
+      rearm(conn);
+      dispatch(type, id, conn->fd, conn->addr, wholeMessage);
+      unref(conn);
+    } else {
+      dispatch(type, id, conn->fd, conn->addr, wholeMessage);
+      rearm(conn);
+    }
+    return true;
+  }
+  
+  // multiplexed calls: a frame whose type has RpcTag carries a 64-bit correlation id as the last 8 bytes of its body.
+  // the reply to it is tagged the same way, so many calls can be in flight on one connection and complete out of order.
+  // handlers are unaware of it: while serving a call, my_write to the calling fd tags the frame (see CallContext)
+  static const uint32_t RpcTag = 0x80000000U;  // ReadReply seqs stay below 2^31, so the bit is free
+  
+  struct CallContext {
+    int fd;
+    uint64_t corrId;
+  };
+  inline static thread_local CallContext currentCall = {-1, 0};
+  
+  // re-installs a captured call on another thread, e.g. when the reply is sent from an I/O completion
+  struct CallScope {
+    CallContext saved;
+    
+    explicit CallScope(const CallContext &call) : saved(currentCall) { currentCall = call; }
+    
+    ~CallScope() { currentCall = saved; }
+  };
+  
+  void dispatch(uint type, int id, int fd, const string &addr, vector<char> &msg) {
+    if (!(type & RpcTag) || msg.size() < 8) {
+      onMessage(type, id, fd, addr, msg);
+      return;
+    }
+    
+    CallContext call;
+    call.fd = fd;
+    memcpy(&call.corrId, msg.data() + msg.size() - 8, 8);
+    msg.resize(msg.size() - 8);
+    
+    CallScope scope(call);
+    onMessage(type & ~RpcTag, id, fd, addr, msg);
+  }
+  
+  // tagged frames from several threads may share a connection, so each is written whole under a lock of its fd
+  mutex tagLocks[256];
+  
+  int my_write_tagged(int fd, uint32_t type, int id, const void *data, uint32_t length, uint64_t corrId) {
+    iovec part = {(void *) data, length};
+    return my_writev_tagged(fd, type, id, &part, 1, corrId);
+  }
+  
+  int my_writev_tagged(int fd, uint32_t type, int id, const iovec *parts, int nParts, uint64_t corrId) {
+    uint32_t header[3] = {type | RpcTag, (uint32_t) id, 8};
+    vector<iovec> iov(nParts + 2);
+    iov[0] = {header, sizeof(header)};
+    for (int i = 0; i < nParts; ++i) {
+      iov[i + 1] = parts[i];
+      header[2] += parts[i].iov_len;
+    }
+    iov[nParts + 1] = {&corrId, 8};
+    
+    lock_guard<mutex> g(tagLocks[fd % 256]);
+    return sendParts(fd, iov.data(), iov.size());
+  }
+  
+  // writes all the parts with sendmsg, resuming after partial sends. the iovecs are consumed
+  static int sendParts(int fd, iovec *iov, int n) {
+    msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = n;
+    
+    while (hdr.msg_iovlen) {
+      ssize_t sent = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+      if (sent <= 0) return (-1);
+      
+      while (hdr.msg_iovlen && sent >= (ssize_t) hdr.msg_iov->iov_len) {  // skip what is fully sent
+        sent -= hdr.msg_iov->iov_len;
+        hdr.msg_iov++;
+        hdr.msg_iovlen--;
+      }
+      if (hdr.msg_iovlen) {
+        hdr.msg_iov->iov_base = (char *) hdr.msg_iov->iov_base + sent;
+        hdr.msg_iov->iov_len -= sent;
+      }
+    }
+    return (0);
+  }
+  
+  // the calling side: one long-lived connection per peer, and a reader thread completing the calls by correlation id
+  struct RpcChannel {
+    int fd = -1;
+    bool broken = false;
+    mutex pendingLock;
+    unordered_map<uint64_t, function<void(vector<char> &&)>> pending;
+    
+    ~RpcChannel() {
+      if (fd >= 0) close(fd);
+    }
+  };
+  
+  recursive_mutex channelLock;
+  unordered_map<string, shared_ptr<RpcChannel>> channels;
+  atomic<uint64_t> nextCorrId{1};
+  
+  // a broken channel if the peer cannot be reached: the calls on it fail with an empty reply, and the next one tries
+  // to connect again
+  shared_ptr<RpcChannel> getChannel(const string &addrPort) {
+    mylock_guard g(channelLock);
+    shared_ptr<RpcChannel> &channel = channels[addrPort];
+    if (channel && !channel->broken) return channel;
+    
+    channel = make_shared<RpcChannel>();
+    channel->fd = connectToServer(addrPort, false);
+    if (channel->fd < 0) {
+      channel->broken = true;
+      return channel;
+    }
+    thread([this, channel]() {
+      prctl(PR_SET_NAME, (name + " rpc").c_str(), 0, 0, 0);
+      
+      while (true) {
+        auto tuple = my_read(channel->fd);
+        vector<char> &body = get<2>(tuple);
+        if (!(get<0>(tuple) & RpcTag) || body.size() < 8) break;
+        
+        uint64_t corrId;
+        memcpy(&corrId, body.data() + body.size() - 8, 8);
+        body.resize(body.size() - 8);
+        
+        complete(*channel, corrId, move(body));  // unknown ids, e.g. timed out, are dropped
+      }
+      
+      // every call still pending on this connection fails with an empty reply. the next call reconnects
+      unordered_map<uint64_t, function<void(vector<char> &&)>> failed;
+      {
+        lock_guard<mutex> gp(channel->pendingLock);
+        channel->broken = true;
+        failed.swap(channel->pending);
+      }
+      shutdown(channel->fd, SHUT_RDWR);
+      for (auto &p: failed) p.second({});
+    }).detach();
+    
+    return channel;
+  }
+  
+  // runs the callback of a pending call, at most once: the reply, the broken connection and the timeout race for it
+  static void complete(RpcChannel &channel, uint64_t corrId, vector<char> &&reply) {
+    function<void(vector<char> &&)> done;
+    {
+      lock_guard<mutex> gp(channel.pendingLock);
+      auto it = channel.pending.find(corrId);
+      if (it == channel.pending.end()) return;
+      done = move(it->second);
+      channel.pending.erase(it);
+    }
+    done(move(reply));
+  }
+  
+  // an empty reply means the connection broke before the reply arrived, or none came within timeoutMs (0: none)
+  future<vector<char>> call(const string &addrPort, uint32_t type, int id, const void *data, uint32_t length,
+                            uint timeoutMs = 0) {
+    auto p = make_shared<promise<vector<char>>>();
+    iovec part = {(void *) data, length};
+    callAsync(addrPort, type, id, &part, 1, [p](vector<char> &&reply) { p->set_value(move(reply)); }, timeoutMs);
+    return p->get_future();
+  }
+  
+  // the same without a waiting thread: done gets the reply, or an empty one if the connection broke or no reply
+  // came within timeoutMs (0: none). it runs on the channel's reader thread or the timer thread, so it must not
+  // block, least of all on another call
+  void callAsync(const string &addrPort, uint32_t type, int id, const iovec *parts, int nParts,
+                 function<void(vector<char> &&)> done, uint timeoutMs = 0) {
+    shared_ptr<RpcChannel> channel = getChannel(addrPort);
+    uint64_t corrId = nextCorrId++;
+    bool broken;
+    {
+      lock_guard<mutex> gp(channel->pendingLock);
+      broken = channel->broken;
+      if (!broken) channel->pending.emplace(corrId, move(done));
+    }
+    if (broken) {
+      done({});
+      return;
+    }
+    if (timeoutMs) expireAt(chrono::steady_clock::now() + chrono::milliseconds(timeoutMs), channel, corrId);
+    
+    if (my_writev_tagged(channel->fd, type, id, parts, nParts, corrId) < 0) {
+      shutdown(channel->fd, SHUT_RDWR);  // the reader fails the pending calls, including this one
+    }
+  }
+  
+  // call deadlines, failed by one timer thread, started on the first one
+  mutex timerLock;
+  condition_variable timerCv;
+  multimap<chrono::steady_clock::time_point, pair<weak_ptr<RpcChannel>, uint64_t>> deadlines;
+  bool timerStarted = false;
+  
+  void expireAt(chrono::steady_clock::time_point deadline, const shared_ptr<RpcChannel> &channel, uint64_t corrId) {
+    lock_guard<mutex> g(timerLock);
+    bool first = deadlines.empty() || deadline < deadlines.begin()->first;
+    deadlines.emplace(deadline, make_pair(weak_ptr<RpcChannel>(channel), corrId));
+    if (first) timerCv.notify_one();
+    if (timerStarted) return;
+    
+    timerStarted = true;
+    thread([this]() {
+      prctl(PR_SET_NAME, (name + " timer").c_str(), 0, 0, 0);
+      
+      unique_lock<mutex> g(timerLock);
+      while (true) {
+        if (deadlines.empty()) {
+          timerCv.wait(g);
+          continue;
+        }
+        auto first = deadlines.begin();
+        if (chrono::steady_clock::now() < first->first) {
+          timerCv.wait_until(g, first->first);
+          continue;
+        }
+        
+        auto expired = first->second;
+        deadlines.erase(first);
+        g.unlock();
+        if (auto channel = expired.first.lock()) complete(*channel, expired.second, {});  // no-op if already replied
+        g.lock();
+      }
+    }).detach();
+  }
+  
+  int connectToServer(string host, bool fatal = true) {
     int index = host.find_last_of(':');
     host[index] = 0;
     
-    return connectToServer(host.c_str(), atoi(host.c_str() + index + 1));
+    return connectToServer(host.c_str(), atoi(host.c_str() + index + 1), fatal);
   }
   
   void error(string msg) {
@@ -173,7 +526,8 @@ public:
     exit(1);
   }
   
-  int connectToServer(const char *host, uint16_t portno) {
+  // not fatal: returns -1 instead, for peers that may be gone, e.g. clients
+  int connectToServer(const char *host, uint16_t portno, bool fatal = true) {
 //// log(string("connecting to server: ") + host);
     
     int sockfd, n;
@@ -186,6 +540,10 @@ public:
       error("ERROR opening socket");
     server = gethostbyname(host);
     if (server == NULL) {
+      if (!fatal) {
+        close(sockfd);
+        return -1;
+      }
       error("ERROR, no such host: " + string(host));
     }
     bzero((char *) &serv_addr, sizeof(serv_addr));
@@ -194,18 +552,85 @@ public:
           (char *) &serv_addr.sin_addr.s_addr,
           server->h_length);
     serv_addr.sin_port = htons(portno);
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+      if (!fatal) {
+        close(sockfd);
+        return -1;
+      }
       error("ERROR connecting host: " + string(host));
+    }
+    
+    // frames go out whole in one send, so there is nothing for Nagle to merge. it would only hold back small
+    // frames, e.g., packed objects, until the previous one is acked
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
 //// log(string("connected to server: ") + host);
     return sockfd;
   }
   
+  // idle connections per destination "host:port", reused instead of a handshake per message.
+  // a connection is owned by one caller between acquire and release, so frames never interleave.
+  // one-way frames (oneWay) have a pool of their own: some of them still draw a reply, e.g. the Return of an Insert
+  // sent by Copy, which may arrive after the release. on an exchange connection it would be read as the next
+  // caller's reply. on a one-way connection, nobody reads it, and isHealthy drops it
+  uint maxIdleConnections = 16;  // per destination
+  recursive_mutex poolLock;
+  unordered_map<string, vector<int>> connectionPool, oneWayPool;
+  
+  int acquireConnection(const string &addrPort, bool fatal = true, bool oneWay = false) {
+    auto &pool = oneWay ? oneWayPool : connectionPool;
+    while (true) {
+      int fd = -1;
+      {
+        mylock_guard g(poolLock);
+        auto it = pool.find(addrPort);
+        if (it == pool.end() || it->second.empty()) break;
+        
+        fd = it->second.back();
+        it->second.pop_back();
+      }
+      
+      if (isHealthy(fd)) return fd;
+      close(fd);
+    }
+    
+    return connectToServer(addrPort, fatal);
+  }
+  
+  // give back a connection whose request/reply exchange is complete. on a broken exchange, close it instead
+  void releaseConnection(const string &addrPort, int fd, bool oneWay = false) {
+    mylock_guard g(poolLock);
+    vector<int> &idle = (oneWay ? oneWayPool : connectionPool)[addrPort];
+    if (idle.size() < maxIdleConnections) {
+      idle.push_back(fd);
+    } else {
+      close(fd);
+    }
+  }
+  
+  // after a blocking my_read on a pooled connection: an empty reply means the connection is unusable
+  void finishExchange(const string &addrPort, int fd, const vector<char> &reply) {
+    if (reply.empty()) close(fd);
+    else releaseConnection(addrPort, fd);
+  }
+  
+  // discards the replies nobody waits for on one-way connections, and detects a closed peer
+  bool isHealthy(int fd) {
+    char buffer[256];
+    while (true) {
+      ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (n > 0) continue;
+      if (n == 0) return false;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+  }
+  
   int raw_write(int fd, void *data, uint length) {
     int bytes_left = length;
     char *ptr = static_cast<char *>(data);
     while (bytes_left > 0) {
-      int written_bytes = write(fd, ptr, bytes_left);
+      int written_bytes = send(fd, ptr, bytes_left, MSG_NOSIGNAL);
       if (written_bytes <= 0) {
         return (-1);
       }
@@ -250,10 +675,44 @@ public:
     return my_write(addrPort, type, id, data.data(), data.length() + 1);
   }
   
+  // one frame whose body is the parts, written without first joining them
+  int my_writev(int fd, uint32_t type, int id, const iovec *parts, int nParts) {
+    uint32_t header[3] = {type, (uint32_t) id, 0};
+    vector<iovec> iov(nParts + 1);
+    iov[0] = {header, sizeof(header)};
+    for (int i = 0; i < nParts; ++i) {
+      iov[i + 1] = parts[i];
+      header[2] += parts[i].iov_len;
+    }
+    return sendParts(fd, iov.data(), iov.size());
+  }
+  
+  int my_writev(const string &addrPort, uint32_t type, int id, const iovec *parts, int nParts) {
+    int fd = acquireConnection(addrPort, true, true);
+    int result = my_writev(fd, type, id, parts, nParts);
+    if (result < 0) {
+      close(fd);
+      fd = connectToServer(addrPort);
+      result = my_writev(fd, type, id, parts, nParts);
+    }
+    
+    if (result < 0) close(fd);
+    else releaseConnection(addrPort, fd, true);
+    
+    return result;
+  }
+  
   int my_write(const string &addrPort, uint32_t type, int id, const void *data, uint32_t length) {
-    int fd = connectToServer(addrPort);
+    int fd = acquireConnection(addrPort, true, true);
     int result = my_write(fd, type, id, data, length);
-    close(fd);
+    if (result < 0) {  // the pooled connection died after the health check. one fresh retry
+      close(fd);
+      fd = connectToServer(addrPort);
+      result = my_write(fd, type, id, data, length);
+    }
+    
+    if (result < 0) close(fd);
+    else releaseConnection(addrPort, fd, true);
     
     return result;
   }
@@ -313,31 +772,53 @@ public:
   
   // format: 4B type, 4B length, and then the msg under that length
   int my_write(int fd, uint32_t type, int id, const void *data, uint32_t length) {
+    if (currentCall.fd == fd) return my_write_tagged(fd, type, id, data, length, currentCall.corrId);
+    
     ostringstream oss;
     oss << "Send message type: " << MessageTypeNames[min(type, (uint) ReadReply)] << ", as " << name;
   // log(oss.str());
     
-    int written_bytes = write(fd, &type, 4);
-    if (written_bytes <= 0) return (-1);
-    
-    written_bytes = write(fd, &id, 4);
-    if (written_bytes <= 0) return (-1);
-    
-    written_bytes = write(fd, &length, 4);
-    if (written_bytes <= 0) return (-1);
+    // header and body in one sendmsg, with MSG_NOSIGNAL: a pooled connection may be closed by the peer
+    uint32_t header[3] = {type, (uint32_t) id, length};
+    iovec iov[2] = {{header, sizeof(header)}, {(void *) data, length}};
+    return sendParts(fd, iov, 2);
+  }
+  
+  // same frame as my_write, but the body is <prefix, length bytes of fileFd at offset>, and the file part goes
+  // from the page cache to the socket via sendfile without passing through user space
+  int my_sendfile(int fd, uint32_t type, int id, int fileFd, uint64_t offset, uint32_t length,
+                  const void *prefix = nullptr, uint32_t prefixLength = 0, const void *suffix = nullptr, uint32_t suffixLength = 0) {
+    uint32_t header[3] = {type, (uint32_t) id, prefixLength + length + suffixLength};
+    if (send(fd, header, sizeof(header), MSG_NOSIGNAL | (header[2] ? MSG_MORE : 0)) != sizeof(header)) return (-1);
+    if (prefixLength && raw_write(fd, (void *) prefix, prefixLength) < 0) return (-1);
     
-    int bytes_left = length;
-    const char *ptr = (const char *) data;
+    off_t off = offset;
+    uint32_t bytes_left = length;
     while (bytes_left > 0) {
-      written_bytes = write(fd, ptr, bytes_left);
-      if (written_bytes <= 0) return (-1);
-      
-      bytes_left -= written_bytes;
-      ptr += written_bytes;
+      ssize_t sent = sendfile(fd, fileFd, &off, bytes_left);
+      if (sent <= 0) return (-1);
+      bytes_left -= sent;
     }
+    if (suffixLength && raw_write(fd, (void *) suffix, suffixLength) < 0) return (-1);
     return (0);
   }
   
+  int my_sendfile(const string &addrPort, uint32_t type, int id, int fileFd, uint64_t offset, uint32_t length,
+                  const void *prefix = nullptr, uint32_t prefixLength = 0, const void *suffix = nullptr, uint32_t suffixLength = 0) {
+    int fd = acquireConnection(addrPort, true, true);
+    int result = my_sendfile(fd, type, id, fileFd, offset, length, prefix, prefixLength, suffix, suffixLength);
+    if (result < 0) {
+      close(fd);
+      fd = connectToServer(addrPort);
+      result = my_sendfile(fd, type, id, fileFd, offset, length, prefix, prefixLength, suffix, suffixLength);
+    }
+    
+    if (result < 0) close(fd);
+    else releaseConnection(addrPort, fd, true);
+    
+    return result;
+  }
+  
   // format
   tuple<uint, int, vector<char>> my_read(int fd) {
     uint type = -1;
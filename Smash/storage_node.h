@@ -1,83 +1,373 @@
 #pragma once
 
 #include <fcntl.h>
+#include <shared_mutex>
 #include "node.h"
-#include "../CuckooPresized/cuckoo_ht.h"
+#include "uring_engine.h"
+#include "../utils/heavy_hitters.h"
 
 class Storage : public Node {
 public:
-  struct Log {
-    uint16_t count; // low 6 bits are fraction bits. Just add 64 for acc.
-    uint16_t time;  // should be decreased by 10% every 8 sec
+  // the blocks are interleaved over the devices (files or block devices), so consecutive ones land on different
+  // disks: block b is block b / n of device b % n. each device has an io_uring engine of its own, i.e., its own
+  // queue and ring thread. the node registers their combined capacity, and stays one failure domain for placement
+  vector<int> devices;  // fds
+  uint32_t size;        // in blocks, of all devices
+  string fileName;      // of the first device. the side files are named after it
+  
+  inline int fileOf(uint32_t blkId) const {
+    return devices[blkId % devices.size()];
+  }
+  
+  // objects are of any length up to blockSize, one per block. the lengths are kept in a side file, stored + 1,
+  // so 0 still means a block written before lengths were kept, i.e., a full one
+  int lengthFile = -1;
+  vector<uint32_t> lengths;
+  
+  // packed objects share segment blocks instead: blkId -> (byte offset -> length). the index is kept in a side log of
+  // <blkId, offset, length> records, where length -1 drops one object and -2 a whole segment. it is replayed and
+  // rewritten without the dropped records on start
+  int segmentFile = -1;
+  recursive_mutex segmentLock;
+  unordered_map<uint32_t, map<uint32_t, uint32_t>> segments;
+  
+  // a length tagged MovedOut is an object Compact copied out. it is still read, but no longer rewritten in place, so
+  // an update racing the move fails and the client inserts it anew. the master's Remove drops it once no key is left
+  static const uint32_t MovedOut = 0x80000000U;
+  
+  inline uint32_t segmentEntry(uint32_t blkId, uint32_t blkOffset) {
+    mylock_guard g(segmentLock);
+    auto it = segments.find(blkId);
+    if (it == segments.end()) return 0;
+    auto object = it->second.find(blkOffset & ~Location::Packed);
+    return object == it->second.end() ? 0 : object->second;
+  }
+  
+  // blkOffset: Location::offset, i.e., tagged with Location::Packed for an object in a segment
+  inline uint32_t objectLength(uint32_t blkId, uint32_t blkOffset = 0) {
+    if (blkOffset & Location::Packed) return segmentEntry(blkId, blkOffset) & ~MovedOut;
     
-    inline Log &update(uint acc = 0) {
-      uint16_t curr = std::time(0);
-      uint16_t diff = curr - time;
-      
-      if (diff >= 8) {
-        count *= pow(0.9, diff / 8.0);
-        time = curr;
-      }
-      
-      if (acc) {
-        count = min(count + 64U * acc, (uint32_t(-1)) >> 16);
-      }
-      return *this;
+    uint32_t stored = lengths[blkId];
+    return stored ? stored - 1 : blockSize;
+  }
+  
+  inline uint64_t objectStart(uint32_t blkId, uint32_t blkOffset = 0) {
+    return uint64_t(blkId / devices.size()) * blockSize + Location::byteOffset(blkOffset);
+  }
+  
+  // a packed object is rewritten in place, so it may not outgrow the extent the master gave it
+  inline bool fits(uint32_t blkId, uint32_t blkOffset, uint32_t length) {
+    if (!(blkOffset & Location::Packed)) return length <= blockSize;
+    uint32_t old = segmentEntry(blkId, blkOffset);
+    return !old || (!(old & MovedOut) && packedExtent(length) <= packedExtent(old));
+  }
+  
+  // tags a packed object as moved out, or clears the tag of one whose move failed. returns its length
+  inline uint32_t markMoved(uint32_t blkId, uint32_t blkOffset, bool moved) {
+    mylock_guard g(segmentLock);
+    uint32_t length = objectLength(blkId, blkOffset);
+    if (length) setObjectLength(blkId, moved ? length | MovedOut : length, blkOffset);
+    return length;
+  }
+  
+  inline void setObjectLength(uint32_t blkId, uint32_t length, uint32_t blkOffset = 0) {
+    mylock_guard g(segmentLock);
+    if (blkOffset & Location::Packed) {
+      segments[blkId][blkOffset & ~Location::Packed] = length;
+      logSegment(blkId, blkOffset & ~Location::Packed, length);
+      return;
     }
-  };
+    
+    uint32_t stored = length + 1;
+    lengths[blkId] = stored;
+    pwrite(lengthFile, &stored, 4, uint64_t(blkId) * 4);
+    if (segments.erase(blkId)) logSegment(blkId, 0, -2);  // a freed segment given to a whole object
+  }
+  
+  inline void dropObject(uint32_t blkId, uint32_t blkOffset) {
+    mylock_guard g(segmentLock);
+    auto it = segments.find(blkId);
+    if (it == segments.end() || !it->second.erase(blkOffset & ~Location::Packed)) return;
+    
+    if (it->second.empty()) segments.erase(it);
+    logSegment(blkId, blkOffset & ~Location::Packed, -1);
+  }
   
-  int storageFile = -1; // fd
-  uint32_t size;
-  string fileName;
+  inline void logSegment(uint32_t blkId, uint32_t offset, uint32_t length) {
+    uint32_t record[3] = {blkId, offset, length};
+    write(segmentFile, record, sizeof(record));  // O_APPEND
+  }
   
-  recursive_mutex logLock;
-  CuckooHashTable<uint32_t, Log> logs = CuckooHashTable<uint32_t, Log>(500U);
+  void loadSegments() {
+    segmentFile = open((fileName + ".seg").c_str(), O_RDWR | O_CREAT | O_APPEND, 0666);
+    vector<uint32_t> records(lseek(segmentFile, 0, SEEK_END) / 12 * 3);
+    pread(segmentFile, records.data(), records.size() * 4, 0);
+    
+    for (uint64_t i = 0; i < records.size(); i += 3) {
+      uint32_t blkId = records[i], offset = records[i + 1], length = records[i + 2];
+      if (length == uint32_t(-2)) segments.erase(blkId);
+      else if (length == uint32_t(-1)) segments[blkId].erase(offset);
+      else segments[blkId][offset] = length;
+    }
+    
+    ftruncate(segmentFile, 0);
+    for (auto &segment: segments) {
+      for (auto &object: segment.second) logSegment(segment.first, object.first, object.second);
+    }
+  }
+  
+  // accesses per block, for Hot and the cache. lossy: only the hottest few hundred blocks are told apart
+  HeavyHitters logs;
   
   inline void acc(const uint32_t blkId, uint times = 1) {
-    mylock_guard g(logLock);
-    Log log;
+    logs.add(blkId, times);
+  }
+  
+  inline uint heat(const uint32_t blkId) {
+    return logs.estimate(blkId);
+  }
+  
+  // hot blocks kept in memory, so their reads do not touch the devices. admission goes by the heat in logs: a block
+  // read while hotter than the coldest of cacheSamples random cached ones takes its place. writes drop the cached
+  // copy, and bump cacheEpoch, so a load racing a write is not admitted
+  inline static uint cacheBlocks = 0;  // 0: off
+  inline static uint cacheSamples = 8;
+  recursive_mutex cacheLock;
+  unordered_map<uint32_t, pair<shared_ptr<const vector<char>>, uint32_t>> cache;  // blkId -> (copy, # in cachedIds)
+  vector<uint32_t> cachedIds;  // the keys of cache, to sample from
+  atomic<uint64_t> cacheEpoch{0};
+  
+  inline shared_ptr<const vector<char>> cachedBlock(uint32_t blkId) {
+    mylock_guard g(cacheLock);
+    auto it = cache.find(blkId);
+    return it == cache.end() ? nullptr : it->second.first;
+  }
+  
+  inline void dropCached(uint32_t blkId) {
+    if (!cacheBlocks) return;
+    cacheEpoch++;
+    mylock_guard g(cacheLock);
+    uncache(blkId);
+  }
+  
+  // under cacheLock. the last id takes the place of the dropped one
+  void uncache(uint32_t blkId) {
+    auto it = cache.find(blkId);
+    if (it == cache.end()) return;
+    
+    uint32_t i = it->second.second;
+    cachedIds[i] = cachedIds.back();
+    cache[cachedIds[i]].second = i;
+    cachedIds.pop_back();
+    cache.erase(it);
+  }
+  
+  // the cached copy of a block, loaded now if the block is hot enough. a segment is loaded whole, a block with one
+  // object up to its length
+  shared_ptr<const vector<char>> cacheBlock(uint32_t blkId) {
+    if (!cacheBlocks) return nullptr;
+    auto block = cachedBlock(blkId);
+    if (block || !admits(blkId)) return block;
+    
+    uint64_t epoch = cacheEpoch;
+    bool segment;
+    {
+      mylock_guard g(segmentLock);
+      segment = segments.count(blkId);
+    }
+    auto loaded = make_shared<vector<char>>(segment ? blockSize : objectLength(blkId));
+    {
+      auto g = readLock(blkId);
+      if (pread(fileOf(blkId), loaded->data(), loaded->size(), objectStart(blkId)) != (ssize_t) loaded->size()) return nullptr;
+    }
+    
+    mylock_guard g(cacheLock);
+    if (epoch != cacheEpoch) return nullptr;
+    uncache(blkId);  // loaded by another read meanwhile
+    if (cache.size() >= cacheBlocks) uncache(sampleColdest());
+    cache[blkId] = {loaded, uint32_t(cachedIds.size())};
+    cachedIds.push_back(blkId);
+    return loaded;
+  }
+  
+  // the cached copy of a block, and the length of the object at blkOffset in it. a whole-block copy is the object as
+  // it was loaded, so one rewritten longer since is not read past the copy
+  shared_ptr<const vector<char>> cachedObject(uint32_t blkId, uint32_t blkOffset, uint32_t &length) {
+    auto block = cacheBlock(blkId);
+    if (!block) return nullptr;
     
-    if (!logs.lookUp(blkId, log)) {
-      log = {(uint16_t)(64 * times), (uint16_t) time(0)};
-      logs.overwriteWorst(blkId, log, [](uint32_t &blkId, Log &log) { return log.update().count; });
+    if (!(blkOffset & Location::Packed)) {
+      length = block->size();
     } else {
-      log.update(times);
-      logs.changeValue(blkId, log);
+      auto g = readLock(blkId);
+      uint32_t start = min<size_t>(Location::byteOffset(blkOffset), block->size());
+      length = min<size_t>(objectLength(blkId, blkOffset), block->size() - start);
     }
+    return block;
   }
   
-  void onCongestion() {
-    vector <pair<int, uint>> tmp;
-    tmp.reserve(512);
-    
-    logLock.lock();
-    for (auto &bucket: logs.buckets_) {  // all buckets
-      for (int slot = 0; slot < 4; ++slot) {
-        if (bucket.occupiedMask & (1ULL << slot)) {
-          bucket.values[slot].update();
-          tmp.emplace_back(-bucket.values[slot].count, bucket.keys[slot]);
-        }
+  bool admits(uint32_t blkId) {
+    mylock_guard g(cacheLock);
+    if (cache.size() < cacheBlocks) return true;
+    return heat(sampleColdest()) < heat(blkId);
+  }
+  
+  // the coldest of a few cached blocks picked at random, as the eviction candidate. under cacheLock, cache not empty
+  uint32_t sampleColdest() {
+    uint32_t coldest = cachedIds[rand() % cachedIds.size()];
+    uint coldestHeat = heat(coldest);
+    for (uint i = 1; i < cacheSamples; ++i) {
+      uint32_t blkId = cachedIds[rand() % cachedIds.size()];
+      uint h = heat(blkId);
+      if (h < coldestHeat) {
+        coldestHeat = h;
+        coldest = blkId;
       }
     }
-    logLock.unlock();
+    return coldest;
+  }
+  
+  // a Read of a whole erasure-coded object, as forwarded by a lookup, is answered with status 2: the client reads
+  // the fragments itself. its own fragment reads come untagged
+  bool redirectStriped(uint32_t seq, const string &clientAddr, uint32_t blkOffset) {
+    if (!Location::striped(blkOffset)) return false;
+    char status = 2;
+    my_write(clientAddr, seq, &status, 1);
+    return true;
+  }
+  
+  // serves a Read from the cache. false if the block is not cached (and not hot enough to be)
+  bool readCached(uint32_t seq, const string &clientAddr, uint32_t blkId, uint32_t blkOffset, uint32_t offset,
+                  uint32_t length) {
+    uint32_t size;
+    auto block = cachedObject(blkId, blkOffset, size);
+    if (!block) return false;
     
-    sort(tmp.begin(), tmp.end());
+    offset = min(offset, size);
+    length = min(length, size - offset);
+    
+    char ok = 1;
+    iovec parts[2] = {{(void *) (block->data() + Location::byteOffset(blkOffset) + offset), length}, {&ok, 1}};
+    my_writev(clientAddr, seq, parts, 2);
+    return true;
+  }
+  
+  void onCongestion() {
+    auto hot = logs.top(5);
     
-    int count = min(5UL, tmp.size());
     vector <u_char> msg;
-    msg.resize(count * sizeof(uint));
+    msg.resize(hot.size() * sizeof(uint));
     uint *p = (uint *) msg.data();
-    for (int i = 0; i < count; ++i) {
-      p[i] = tmp[i].second;
+    for (size_t i = 0; i < hot.size(); ++i) {
+      p[i] = hot[i].first;
     }
     
     my_write(nameServer, Hot, msg);
   }
   
-  Storage(uint64_t size, string fileName, uint16_t port = 0) :
-      Node("Storage", port), size(size), fileName(fileName) {
-    storageFile = open(fileName.c_str(), O_RDWR | O_CREAT, 0666);
-    ftruncate(storageFile, size * blockSize);
+  // self-monitoring: Read/Insert/Remove in progress, the latency of their local I/O (log2 histogram in us) and the
+  // bytes they move. a monitor thread samples these every second, and sends Hot by itself when a threshold is
+  // crossed, at most once per hotReportGap. 0 turns a threshold off
+  inline static uint congestionInflight = 0;  // requests in progress, at the peak of the second
+  inline static uint congestionP99 = 0;       // us
+  inline static uint64_t congestionBandwidth = 0;  // bytes per second
+  inline static uint hotReportGap = 10;       // seconds
+  
+  atomic<uint> inflight{0}, inflightPeak{0};
+  atomic<uint64_t> bytesServed{0};
+  atomic<uint32_t> latencies[32] = {};
+  
+  mutex monitorLock;
+  condition_variable monitorCv;
+  bool monitoring = true;
+  thread monitor;
+  
+  inline chrono::steady_clock::time_point began() {
+    uint now = ++inflight, peak = inflightPeak;
+    while (now > peak && !inflightPeak.compare_exchange_weak(peak, now)) {}
+    return chrono::steady_clock::now();
+  }
+  
+  inline void ended(chrono::steady_clock::time_point start, uint64_t bytes) {
+    uint64_t us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    latencies[min(63 - __builtin_clzll(us | 1), 31)]++;
+    bytesServed += bytes;
+    inflight--;
+  }
+  
+  void monitorLoop() {
+    auto lastReport = chrono::steady_clock::now() - chrono::seconds(hotReportGap);
+    unique_lock<mutex> g(monitorLock);
+    while (!monitorCv.wait_for(g, chrono::seconds(1), [this] { return !monitoring; })) {
+      uint peak = inflightPeak.exchange(inflight);
+      uint64_t bytes = bytesServed.exchange(0);
+      uint32_t histogram[32], total = 0;
+      for (int i = 0; i < 32; ++i) total += histogram[i] = latencies[i].exchange(0);
+      
+      uint p99 = 0;  // upper end of the bucket holding the 99th percentile
+      for (uint32_t i = 0, seen = 0; i < 32 && total; ++i) {
+        seen += histogram[i];
+        if (seen * 100ULL >= total * 99ULL) {
+          p99 = 2U << i;
+          break;
+        }
+      }
+      
+      bool congested = (congestionInflight && peak >= congestionInflight) || (congestionP99 && p99 >= congestionP99) ||
+                       (congestionBandwidth && bytes >= congestionBandwidth);
+      auto now = chrono::steady_clock::now();
+      if (!congested || now - lastReport < chrono::seconds(hotReportGap)) continue;
+      lastReport = now;
+      
+      ostringstream oss;
+      oss << name << " congested: " << peak << " in flight, p99 " << p99 << "us, " << bytes << " B/s";
+      my_write(nameServer, Log, oss.str());
+      onCongestion();
+    }
+  }
+  
+  // queue depth of the io_uring engines for Read/Insert, one per device with its own ring thread, so the devices of a
+  // node are driven in parallel. 0, or a kernel without io_uring, keeps the synchronous pread/pwrite under the stripe
+  // locks, shared by all the devices
+  inline static uint uringDepth = 64;
+  vector<UringEngine *> engines;  // [device #]. empty: off
+  
+  inline UringEngine *engineOf(uint32_t blkId) {
+    return engines[blkId % engines.size()];
+  }
+  
+  Storage(uint64_t size, string fileName, uint16_t port = 0) : Storage(size, vector<string>{fileName}, port) {}
+  
+  Storage(uint64_t deviceSize, const vector<string> &deviceNames, uint16_t port = 0) :
+      Node("Storage", port), size(deviceSize * deviceNames.size()), fileName(deviceNames[0]) {
+    for (auto &name: deviceNames) {
+      devices.push_back(open(name.c_str(), O_RDWR | O_CREAT, 0666));
+      ftruncate(devices.back(), deviceSize * blockSize);  // fails harmlessly on a block device
+    }
+    
+    lengthFile = open((fileName + ".len").c_str(), O_RDWR | O_CREAT, 0666);
+    ftruncate(lengthFile, size * 4);
+    lengths.resize(size);
+    pread(lengthFile, lengths.data(), size * 4, 0);
+    loadSegments();
+    
+    for (uint i = 0; uringDepth && i < devices.size(); ++i) {
+      engines.push_back(new UringEngine(devices[i], uringDepth, 16, blockSize));
+      if (!engines.back()->ok) {  // all or none
+        for (auto *e: engines) delete e;
+        engines.clear();
+        break;
+      }
+    }
+    
+    migrator = thread([this]() {
+      prctl(PR_SET_NAME, "Storage migrator", 0, 0, 0);
+      migrateLoop();
+    });
+    monitor = thread([this]() {
+      prctl(PR_SET_NAME, "Storage monitor", 0, 0, 0);
+      monitorLoop();
+    });
   }
   
   ~Storage() {
@@ -103,71 +393,225 @@ public:
   }
   
   void stop() {
-    close(storageFile);
+    {
+      lock_guard<mutex> g(migrateLock);
+      migrating = false;
+    }
+    migrateCv.notify_all();
+    if (migrator.joinable()) migrator.join();
+    {
+      lock_guard<mutex> g(monitorLock);
+      monitoring = false;
+    }
+    monitorCv.notify_all();
+    if (monitor.joinable()) monitor.join();
+    
+    for (auto *e: engines) delete e;
+    engines.clear();
+    for (int fd: devices) close(fd);
+    close(lengthFile);
+    close(segmentFile);
+  }
+  
+  // per block stripe: Reads and sends of a block share it, writes to it take it alone
+  shared_mutex locks[8192];
+  
+  // io_uring writes outlive the thread that submits them, so instead of holding the stripe they are counted on it,
+  // and the readers and writers below wait for them under the stripe lock. the engine orders its own reads
+  atomic<uint32_t> engineWrites[8192] = {};
+  mutex engineWriteLock;
+  condition_variable engineWriteCv;
+  
+  // false, and not counted, if the object may not be written there (see fits), checked under the stripe so that
+  // Compact sees either the write or the refusal
+  bool beginEngineWrite(uint64_t blkId, uint32_t blkOffset, uint32_t length) {
+    mylock_guard g(locks[blkId % 8192]);  // after the reads of the block in progress
+    if (!fits(blkId, blkOffset, length)) return false;
+    engineWrites[blkId % 8192]++;
+    return true;
+  }
+  
+  void endEngineWrite(uint64_t blkId) {
+    if (--engineWrites[blkId % 8192]) return;
+    lock_guard<mutex> g(engineWriteLock);
+    engineWriteCv.notify_all();
   }
   
-  recursive_mutex locks[8192];
+  void awaitEngineWrites(uint64_t blkId) {
+    if (!engineWrites[blkId % 8192]) return;
+    unique_lock<mutex> g(engineWriteLock);
+    engineWriteCv.wait(g, [&] { return !engineWrites[blkId % 8192]; });
+  }
+  
+  shared_lock<shared_mutex> readLock(uint64_t blkId) {
+    shared_lock<shared_mutex> g(locks[blkId % 8192]);
+    awaitEngineWrites(blkId);
+    return g;
+  }
+  
+  unique_lock<shared_mutex> writeLock(uint64_t blkId) {
+    unique_lock<shared_mutex> g(locks[blkId % 8192]);
+    awaitEngineWrites(blkId);
+    return g;
+  }
+  
+  // a Read forwarded by a lookup names the client as ip:port. a client routing with its own Ludo replica sends
+  // only ":port", and the ip is the one it connected from
+  static string replyAddr(const char *addr, const string &ip) {
+    return addr[0] == ':' ? ip + addr : addr;
+  }
   
   bool onMessage(int msgType, int id, const int fd, const string &ip, vector<char> &msg) override {
     try {
       if (Node::onMessage(msgType, 0, fd, ip, msg)) return true;
       
+      if (!engines.empty() && (msgType == Insert || msgType == Read)) return onMessageAsync(msgType, fd, ip, msg);
+      
       if (msgType == Insert || msgType == Remove) {
         Location *p = (Location *) msg.data();
         assert(p->dId == thisId);
-        
-        if (msgType == Insert) {
-          acc(p->blkId);
-          mylock_guard g(locks[p->blkId % 8192]);
-          pwrite(storageFile, p + nReplicas, msg.size() - sizeof(Location) * nReplicas, uint64_t(p->blkId) * blockSize);
+        Location own = p[0], next = p[1];
+        uint32_t length = msg.size() - sizeof(Location) * nReplicas;
+        if (msgType == Insert && !fits(own.blkId, own.offset, length)) {
+          bool result = false;
+          my_write(fd, Return, &result, 1);
+          return true;
         }
         
-        bool result = true;
-        Location next = p[1];
-        if (next.dId != uint32_t(-1)) {
-          // next presents. let it handle the rest
+        auto start = began();
+        
+        // the other replicas get the object first, so their writes overlap with ours. their replies complete the
+        // quorum on the channel reader thread, so this worker does not wait on them
+        shared_ptr<Quorum> quorum;
+        if (next.dId != uint32_t(-1) && fanOut) {
+          quorum = fanOutTo(msgType, msg, replier(fd));
+        } else if (next.dId != uint32_t(-1)) {
+          // next presents. let it handle the rest. both of us are to succeed
+          quorum = make_shared<Quorum>(2, 2, replier(fd));
           p[0] = p[1];
           p[1] = p[2];
           p[2] = {uint32_t(-1), 0};
           
-          int followerFd = connectToServer(storages[next.dId].addrPort);
-          my_write(followerFd, msgType, msg);
-          result &= (get<2>(my_read(followerFd))[0] == 1);
-          close(followerFd);
+          iovec part = {msg.data(), msg.size()};
+          callAsync(storages[next.dId].addrPort, msgType, &part, 1, [quorum](vector<char> &&reply) {
+            quorum->done(!reply.empty() && reply[0] == 1);
+          }, replicaTimeoutMs);
         }
         
-        my_write(fd, Return, &result, 1);
+        bool written = true;
+        if (msgType == Insert) {
+          acc(own.blkId);
+          mylock_guard g(locks[own.blkId % 8192]);
+          written = fits(own.blkId, own.offset, length);  // again, Compact may have moved it out meanwhile
+          if (written) {
+            pwrite(fileOf(own.blkId), msg.data() + sizeof(Location) * nReplicas, length, objectStart(own.blkId, own.offset));
+            setObjectLength(own.blkId, length, own.offset);
+            dropCached(own.blkId);
+          }
+        } else if (own.packed()) {
+          dropObject(own.blkId, own.offset);
+        }
+        ended(start, msgType == Insert ? length : 0);
+        
+        if (quorum) quorum->done(written, true);
+        else my_write(fd, Return, &written, 1);
       } else if (msgType == Read) {
-        uint32_t seq = *(uint32_t *) msg.data();
-        uint64_t blkId = *((uint32_t *) msg.data() + 1);
+        uint32_t *p = (uint32_t *) msg.data();
+        uint32_t seq = p[0], blkOffset = p[2];
+        uint64_t blkId = p[1];
+        string clientAddr = replyAddr(msg.data() + 20, ip);
+        if (redirectStriped(seq, clientAddr, blkOffset)) return true;
         acc(blkId);
+        auto start = began();
+        if (readCached(seq, clientAddr, blkId, blkOffset, p[3], p[4])) {
+          ended(start, 0);
+          return true;
+        }
         
-        vector<char> buff(blockSize);
-        mylock_guard g(locks[blkId % 8192]);
-        pread(storageFile, buff.data(), blockSize, blkId * blockSize);
+        auto g = readLock(blkId);
+        uint32_t size = objectLength(blkId, blkOffset);
+        uint32_t offset = min(p[3], size), length = min(p[4], size - offset);
 
 //      if (notValid) {   // not implemented. if the wrong value, return. should in some way store the full key
 //        buff.resize(1);
 //      }
         
-        my_write(msg.data() + 8, seq, buff);
+        // timed up to the read from the device, which readahead waits for, and not the send to the client after it
+        readahead(fileOf(blkId), objectStart(blkId, blkOffset) + offset, length);
+        ended(start, length);
+        
+        char ok = 1;
+        my_sendfile(clientAddr, seq, fileOf(blkId), objectStart(blkId, blkOffset) + offset, length, nullptr, 0, &ok, 1);  // zero copy
+      } else if (msgType == MultiRead) {  // served synchronously, also with the io_uring engine
+        uint32_t *p = (uint32_t *) msg.data();
+        uint32_t seq = p[0], n = p[1];
+        string clientAddr = replyAddr(msg.data() + 8 + 12 * n, ip);
+        
+        int clientFd = acquireConnection(clientAddr, false, true);
+        if (clientFd < 0) return true;
+        if (sendBlocks(clientFd, seq, p + 2, n) < 0) close(clientFd);
+        else releaseConnection(clientAddr, clientFd, true);
       } else if (msgType == Copy || msgType == Move) {
         uint32_t *p = (uint32_t *) msg.data();
         
         uint32_t sBlkId = p[0];
         uint32_t dSId = p[1];
         uint32_t dBlkId = p[2];
+        uint32_t sOffset = msg.size() >= 16 ? p[3] : 0;  // a packed object is copied out to a block of its own
         
         Locations onlyFirst;
         onlyFirst.locs[0] = {dSId, dBlkId};
         
-        vector<char> buff(sizeof(Locations) + blockSize);
-        mylock_guard g(locks[sBlkId % 8192]);
-        pread(storageFile, buff.data() + sizeof(Locations), blockSize, sBlkId * blockSize);
-        *(Locations *) buff.data() = onlyFirst;
-        
-        my_write(storages[dSId].addrPort, Insert, buff);
+        auto g = readLock(sBlkId);
+        my_sendfile(storages[dSId].addrPort, Insert, fileOf(sBlkId), objectStart(sBlkId, sOffset), objectLength(sBlkId, sOffset),
+                    &onlyFirst, nReplicas * sizeof(Location));
         //std::this_thread::yield();
+      } else if (msgType == Compact) {
+        uint32_t *p = (uint32_t *) msg.data();
+        uint32_t n = p[0];
+        bool result = true;
+        
+        // the source is tagged under the write stripe, after the writes to it in progress and before any later one.
+        // it stays until the master has pointed the keys away and sends Remove
+        vector<char> object;
+        for (uint32_t i = 0; i < n; ++i) {
+          const uint32_t *move = p + 1 + 4 * i;
+          uint32_t length;
+          bool copied;
+          {
+            auto g = writeLock(move[0]);
+            length = markMoved(move[0], move[1], true);
+            object.resize(length);
+            copied = pread(fileOf(move[0]), object.data(), length, objectStart(move[0], move[1])) == length;
+          }
+          if (!length) continue;  // never written here, or removed: nothing to copy
+          
+          if (copied) {
+            auto g = writeLock(move[2]);
+            copied = pwrite(fileOf(move[2]), object.data(), length, objectStart(move[2], move[3])) == length;
+            setObjectLength(move[2], length, move[3]);
+            dropCached(move[2]);
+          }
+          if (!copied) {
+            auto g = writeLock(move[0]);
+            markMoved(move[0], move[1], false);
+          }
+          result &= copied;
+        }
+        
+        my_write(fd, Return, &result, 1);
+      } else if (msgType == Hot) {  // from the commander
+        onCongestion();
+      } else if (msgType == Migrate) {
+        uint32_t *p = (uint32_t *) msg.data();
+        uint32_t masterId = p[0], n = p[1];
+        auto *moves = (const Migration *) (p + 2);
+        {
+          lock_guard<mutex> g(migrateLock);
+          migrations.emplace_back(masterId, vector<Migration>(moves, moves + n));
+          migrationsLeft += n;
+        }
+        migrateCv.notify_one();
       } else {
         return false;
       }
@@ -177,4 +621,314 @@ public:
     
     return true;
   }
+  
+  // data movement for Leave/Hot: the master sends Migrate batches, and one thread works them off in the background,
+  // a window of objects at a time over one connection to each destination, paced to migrateBandwidth so the
+  // foreground keeps its share of the disk and the network. each window is reported to the master as Migrated
+  inline static uint64_t migrateBandwidth = 0;  // bytes per second. 0: unlimited
+  inline static uint migrateWindow = 64;        // objects sent before waiting for their replies
+  
+  struct Migration {
+    uint32_t sBlkId, sOffset, dSId, dBlkId;
+  };
+  
+  mutex migrateLock;
+  condition_variable migrateCv;
+  deque<pair<uint32_t, vector<Migration>>> migrations;  // (master id, batch)
+  uint32_t migrationsLeft = 0;
+  bool migrating = true;
+  thread migrator;
+  chrono::steady_clock::time_point migrateSlot;  // when the bandwidth budget allows the next object
+  
+  void migrateLoop() {
+    while (true) {
+      pair<uint32_t, vector<Migration>> batch;
+      {
+        unique_lock<mutex> g(migrateLock);
+        migrateCv.wait(g, [this] { return !migrations.empty() || !migrating; });
+        if (!migrating) return;
+        batch = move(migrations.front());
+        migrations.pop_front();
+      }
+      
+      vector<Migration> &moves = batch.second;
+      stable_sort(moves.begin(), moves.end(), [](const Migration &a, const Migration &b) { return a.dSId < b.dSId; });
+      for (uint32_t begin = 0, end; begin < moves.size(); begin = end) {
+        end = begin;
+        while (end < moves.size() && end - begin < migrateWindow && moves[end].dSId == moves[begin].dSId) ++end;
+        
+        vector<bool> moved(end - begin);
+        uint64_t bytes = 0;
+        migrateWindowTo(moves.data() + begin, end - begin, moved, bytes);
+        reportMigrated(batch.first, moves.data() + begin, moved, bytes);
+      }
+    }
+  }
+  
+  // sends the objects, all to the same storage, as Inserts one after another, then collects the replies
+  void migrateWindowTo(const Migration *moves, uint32_t n, vector<bool> &moved, uint64_t &bytes) {
+    const string addr = storages[moves[0].dSId].addrPort;
+    int fd = acquireConnection(addr, false);
+    if (fd < 0) return;
+    
+    uint32_t sent = 0;
+    for (; sent < n; ++sent) {
+      const Migration &m = moves[sent];
+      Locations onlyFirst;
+      onlyFirst.locs[0] = {m.dSId, m.dBlkId};
+      uint32_t length = objectLength(m.sBlkId, m.sOffset);
+      pace(length);
+      
+      // sent as a call, so the reply echoes the index: the destination replies as its writes complete, in any order
+      uint64_t tag = sent;
+      auto g = readLock(m.sBlkId);
+      if (my_sendfile(fd, Insert | RpcTag, fileOf(m.sBlkId), objectStart(m.sBlkId, m.sOffset), length, &onlyFirst,
+                      nReplicas * sizeof(Location), &tag, 8) < 0) break;
+      bytes += length;
+    }
+    
+    vector<char> reply;
+    for (uint32_t i = 0; i < sent; ++i) {
+      auto tuple = my_read(fd);
+      reply = move(get<2>(tuple));
+      uint64_t tag = sent;
+      if (get<0>(tuple) & RpcTag && reply.size() > 8) memcpy(&tag, reply.data() + reply.size() - 8, 8);
+      if (tag >= sent) {  // not a reply to these
+        reply.clear();
+        break;
+      }
+      moved[tag] = reply[0] == 1;
+    }
+    if (sent < n) reply.clear();  // a frame may be cut off
+    finishExchange(addr, fd, reply);
+  }
+  
+  void pace(uint32_t bytes) {
+    if (!migrateBandwidth) return;
+    auto now = chrono::steady_clock::now();
+    if (migrateSlot < now) migrateSlot = now;
+    this_thread::sleep_until(migrateSlot);
+    migrateSlot += chrono::microseconds(bytes * 1000000ULL / migrateBandwidth);
+  }
+  
+  // <sId, moved, failed, left, bytes u64, (Migration) * moved, (Migration) * failed>. the master switches the keys
+  // over to the moved ones only now, and gives up the failed ones
+  void reportMigrated(uint32_t masterId, const Migration *moves, const vector<bool> &moved, uint64_t bytes) {
+    vector<Migration> done, failed;
+    for (uint32_t i = 0; i < moved.size(); ++i) (moved[i] ? done : failed).push_back(moves[i]);
+    
+    vector<char> msg(24 + sizeof(Migration) * moved.size());
+    uint32_t *p = (uint32_t *) msg.data();
+    {
+      lock_guard<mutex> g(migrateLock);
+      migrationsLeft -= moved.size();
+      p[3] = migrationsLeft;
+    }
+    p[0] = thisId;
+    p[1] = done.size();
+    p[2] = failed.size();
+    *(uint64_t *) (p + 4) = bytes;
+    memcpy(msg.data() + 24, done.data(), sizeof(Migration) * done.size());
+    memcpy(msg.data() + 24 + sizeof(Migration) * done.size(), failed.data(), sizeof(Migration) * failed.size());
+    my_write(masters[masterId].addrPort, Migrated, msg);
+  }
+  
+  // fan-out replication: the first replica sends the object to all the other ones at once, each told to keep it to
+  // itself, instead of along the chain. the writer gets its reply once ackQuorum replicas have written it (0: all of
+  // them), and the rest finish in the background. this one is always among them, as reads go to it first
+  inline static bool fanOut = false;
+  inline static uint ackQuorum = 0;
+  inline static uint replicaTimeoutMs = 10000;  // for another replica to reply, or it counts as failed
+  
+  struct Quorum {
+    atomic<int> acks{0}, left;
+    int needed;
+    atomic<bool> ownWritten{false}, ownFailed{false}, replied{false};
+    function<void(bool)> reply;
+    
+    Quorum(int total, int needed, function<void(bool)> reply) : left(total), needed(needed), reply(move(reply)) {}
+    
+    // once per replica, own: this one. replies as soon as the outcome is known
+    void done(bool ok, bool own = false) {
+      if (own) (ok ? ownWritten : ownFailed) = true;
+      if (ok) acks++;
+      int l = --left, a = acks;
+      bool failed = ownFailed || a + l < needed;
+      if (((a >= needed && ownWritten) || failed) && !replied.exchange(true)) reply(!failed);
+    }
+  };
+  
+  // the Return to the writer, also from a thread other than the one serving its request
+  function<void(bool)> replier(int fd) {
+    return [this, fd, call = currentCall](bool ok) {
+      CallScope scope(call);
+      my_write(fd, Return, &ok, 1);
+    };
+  }
+  
+  // msg: <locations, body>, ours first. our own write is to be reported with done() on the returned quorum. the
+  // other replicas report theirs from the channel reader threads
+  shared_ptr<Quorum> fanOutTo(int msgType, vector<char> &msg, function<void(bool)> reply) {
+    Location *p = (Location *) msg.data();
+    Location locations[3] = {p[0], p[1], p[2]};
+    
+    uint total = 1;
+    while (total < nReplicas && locations[total].dId != uint32_t(-1)) ++total;
+    auto quorum = make_shared<Quorum>(total, ackQuorum ? min(ackQuorum, total) : total, move(reply));
+    
+    for (uint r = 1; r < total; ++r) {
+      p[0] = locations[r];
+      p[1] = p[2] = Location();
+      iovec part = {msg.data(), msg.size()};
+      callAsync(storages[locations[r].dId].addrPort, msgType, &part, 1, [quorum](vector<char> &&ack) {
+        quorum->done(!ack.empty() && ack[0] == 1);
+      }, replicaTimeoutMs);
+    }
+    
+    memcpy(p, locations, sizeof(locations));
+    return quorum;
+  }
+  
+  // one MultiRead reply <n, (index, length, object) * n> in one frame. the objects are sent from the file like single reads
+  int sendBlocks(int fd, uint32_t seq, const uint32_t *entries, uint32_t n) {
+    vector<uint32_t> sizes(n);
+    vector<shared_ptr<const vector<char>>> blocks(n);  // the cached ones
+    uint32_t total = 4;
+    for (uint32_t i = 0; i < n; ++i) {
+      uint32_t blkId = entries[3 * i + 1], blkOffset = entries[3 * i + 2];
+      bool striped = Location::striped(blkOffset);  // left to a single read, as not found
+      if (striped) {
+        sizes[i] = uint32_t(-1);
+      } else {
+        acc(blkId);
+        blocks[i] = cachedObject(blkId, blkOffset, sizes[i]);
+        if (!blocks[i]) sizes[i] = objectLength(blkId, blkOffset);
+      }
+      total += 8 + (striped ? 0 : sizes[i]);
+    }
+    
+    uint32_t header[4] = {seq, uint32_t(thisId), total, n};
+    if (send(fd, header, sizeof(header), MSG_NOSIGNAL | MSG_MORE) != sizeof(header)) return (-1);
+    
+    for (uint32_t i = 0; i < n; ++i) {
+      uint32_t blkId = entries[3 * i + 1];
+      uint32_t entry[2] = {entries[3 * i], sizes[i]};
+      if (send(fd, entry, 8, MSG_NOSIGNAL | MSG_MORE) != 8) return (-1);
+      if (sizes[i] == uint32_t(-1)) continue;
+      
+      if (blocks[i]) {
+        iovec object = {(void *) (blocks[i]->data() + Location::byteOffset(entries[3 * i + 2])), sizes[i]};
+        if (sendParts(fd, &object, 1) < 0) return (-1);
+        continue;
+      }
+      
+      auto g = readLock(blkId);
+      off_t off = objectStart(blkId, entries[3 * i + 2]);
+      uint32_t bytes_left = sizes[i];
+      while (bytes_left > 0) {
+        ssize_t sent = sendfile(fd, fileOf(blkId), &off, bytes_left);
+        if (sent <= 0) return (-1);
+        bytes_left -= sent;
+      }
+    }
+    return (0);
+  }
+  
+  // Read/Insert through the io_uring engine: the disk operation is queued, and the reply is sent on its completion,
+  // so the serving thread goes back to the reactor instead of waiting for the disk
+  bool onMessageAsync(int msgType, const int fd, const string &ip, vector<char> &msg) {
+    if (msgType == Read) {
+      uint32_t *p = (uint32_t *) msg.data();
+      uint32_t seq = p[0], blkOffset = p[2];
+      uint64_t blkId = p[1];
+      string clientAddr = replyAddr(msg.data() + 20, ip);
+      if (redirectStriped(seq, clientAddr, blkOffset)) return true;
+      acc(blkId);
+      auto start = began();
+      if (readCached(seq, clientAddr, blkId, blkOffset, p[3], p[4])) {
+        ended(start, 0);
+        return true;
+      }
+      
+      uint32_t size = objectLength(blkId, blkOffset);
+      uint32_t offset = min(p[3], size), length = min(p[4], size - offset);
+      engineOf(blkId)->submit({false, uint32_t(blkId), objectStart(blkId, blkOffset) + offset, length, nullptr,
+                      [this, seq, clientAddr, start](int res, const char *data) {
+                        ended(start, max(res, 0));
+                        if (res < 0) {
+                          my_write(clientAddr, seq, "\0");
+                          return;
+                        }
+                        
+                        char ok = 1;
+                        iovec parts[2] = {{(void *) data, size_t(res)}, {&ok, 1}};
+                        my_writev(clientAddr, seq, parts, 2);
+                      }});
+      return true;
+    }
+    
+    // the block is written locally while it is forwarded to the next replica. whichever finishes last replies
+    auto held = make_shared<vector<char>>(move(msg));
+    Location *p = (Location *) held->data();
+    assert(p->dId == thisId);
+    acc(p->blkId);
+    
+    uint32_t headerSize = sizeof(Location) * nReplicas;
+    uint32_t length = held->size() - headerSize;
+    if (!beginEngineWrite(p->blkId, p->offset, length)) {
+      bool result = false;
+      my_write(fd, Return, &result, 1);
+      return true;
+    }
+    auto start = began();
+    
+    if (p[1].dId != uint32_t(-1) && fanOut) {
+      auto quorum = fanOutTo(Insert, *held, replier(fd));
+      setObjectLength(p->blkId, length, p->offset);
+      dropCached(p->blkId);
+      engineOf(p->blkId)->submit({true, p->blkId, objectStart(p->blkId, p->offset), length, held->data() + headerSize,
+                      [this, held, quorum, start, length, blkId = p->blkId](int res, const char *) {
+                        endEngineWrite(blkId);
+                        ended(start, max(res, 0));
+                        dropCached(blkId);
+                        quorum->done(res == (int) length, true);
+                      }});
+      return true;
+    }
+    
+    auto pending = make_shared<atomic<int>>(2);
+    auto result = make_shared<atomic<bool>>(true);
+    auto finish = [pending, result, reply = replier(fd)]() {
+      if (--*pending) return;
+      reply(*result);  // the last one may be an I/O completion thread
+    };
+    
+    setObjectLength(p->blkId, length, p->offset);
+    dropCached(p->blkId);
+    engineOf(p->blkId)->submit({true, p->blkId, objectStart(p->blkId, p->offset), length, held->data() + headerSize,
+                    [this, held, result, finish, start, length, blkId = p->blkId](int res, const char *) {
+                      endEngineWrite(blkId);
+                      ended(start, max(res, 0));
+                      if (res != (int) length) *result = false;
+                      dropCached(blkId);  // a read may have cached the old data meanwhile
+                      finish();
+                    }});
+    
+    Location next = p[1];
+    if (next.dId == uint32_t(-1)) {
+      finish();
+      return true;
+    }
+    
+    // the engine may still be reading the body, so the shifted locations are sent from a copy of the header.
+    // the follower's reply completes it on the channel's reader thread, not here
+    Location shifted[3] = {p[1], p[2], {uint32_t(-1), 0}};
+    iovec parts[2] = {{shifted, headerSize}, {held->data() + headerSize, length}};
+    callAsync(storages[next.dId].addrPort, Insert, parts, 2, [result, finish](vector<char> &&reply) {
+      if (reply.empty() || reply[0] != 1) *result = false;
+      finish();
+    }, replicaTimeoutMs);
+    
+    return true;
+  }
 };
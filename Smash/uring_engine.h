@@ -0,0 +1,344 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <condition_variable>
+#include "../common.h"
+
+// asynchronous block I/O on one file through io_uring, used by the storage node instead of pread/pwrite.
+// callers only enqueue; a ring thread fills the submission queue in batches (one io_uring_enter per batch),
+// and completions are handed to a few completion threads, which run the callbacks, i.e., the reply path.
+// the file is registered as a fixed file, and the read buffers are registered once and recycled.
+// requests with the same key (the block id) keep their submission order around writes, as the block locks
+// do: reads of a block run together, and a write runs alone, after the ones before it.
+class UringEngine {
+public:
+  struct Request {
+    bool write;
+    uint32_t key;
+    uint64_t offset;
+    uint32_t length;
+    const char *data;  // write only. must stay valid until the callback
+    // res: length, or -errno. a short transfer is resubmitted for the rest, and -EIO if it makes no progress.
+    // data: for reads, the block, only valid during the callback
+    function<void(int res, const char *data)> callback;
+    int bufIndex = -1;
+    bool ownsKey = false;  // let in by the requests before it on the same block, and already counted
+    uint32_t done = 0;  // by the short transfers before
+  };
+  
+  int file;
+  uint depth;
+  bool ok = false;
+  
+  UringEngine(int file, uint depth = 64, uint nBuffers = 16, uint bufferSize = 4 * 1024 * 1024, uint nCompletionThreads = 4)
+      : file(file), depth(depth), bufferSize(bufferSize) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ringFd < 0) {
+      perror("io_uring_setup");
+      return;
+    }
+    this->depth = params.sq_entries;
+    
+    if (!mapRings(params)) return;
+    
+    // fixed file: saves the fget/fput per request. index 0 is our file
+    fixedFile = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, &file, 1) == 0;
+    
+    buffers.resize(nBuffers);
+    vector<iovec> iovecs(nBuffers);
+    for (uint i = 0; i < nBuffers; ++i) {
+      buffers[i] = (char *) aligned_alloc(4096, bufferSize);
+      iovecs[i] = {buffers[i], bufferSize};
+      freeBuffers.push_back(i);
+    }
+    // may fail under a small RLIMIT_MEMLOCK. then the same buffers are used as plain ones
+    fixedBuffers = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), nBuffers) == 0;
+    
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    ok = true;
+    
+    ringThread = thread([this]() {
+      prctl(PR_SET_NAME, "uring ring", 0, 0, 0);
+      ringLoop();
+    });
+    
+    for (uint i = 0; i < nCompletionThreads; ++i) {
+      completionThreads.emplace_back([this]() {
+        prctl(PR_SET_NAME, "uring completion", 0, 0, 0);
+        completionLoop();
+      });
+    }
+  }
+  
+  ~UringEngine() {
+    if (!ok) {
+      if (ringFd >= 0) close(ringFd);
+      return;
+    }
+    
+    {  // the requests still queued or in flight are carried out, and their callbacks run, before the threads stop
+      unique_lock<mutex> g(completionLock);
+      drainedCv.wait(g, [this] { return !outstanding; });
+    }
+    running = false;
+    wake();
+    ringThread.join();
+    completionCv.notify_all();
+    for (auto &t: completionThreads) t.join();
+    
+    close(wakeFd);
+    close(ringFd);
+    for (char *b: buffers) free(b);
+  }
+  
+  void submit(Request &&request) {
+    {
+      lock_guard<mutex> g(completionLock);
+      outstanding++;
+    }
+    {
+      lock_guard<mutex> g(queueLock);
+      incoming.push_back(new Request(move(request)));
+    }
+    wake();
+  }
+
+private:
+  int ringFd = -1;
+  int wakeFd = -1;
+  uint64_t wakeValue;
+  bool wakeArmed = false;
+  bool fixedFile = false, fixedBuffers = false;
+  atomic<bool> running{true};
+  
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  
+  uint bufferSize;
+  vector<char *> buffers;
+  mutex bufferLock;
+  vector<int> freeBuffers;
+  
+  mutex queueLock;
+  deque<Request *> incoming;
+  
+  // only touched by the ring thread
+  deque<Request *> waiting;
+  struct KeyState {
+    uint readers = 0;
+    bool writer = false;
+    deque<Request *> queued;  // behind the in-flight ones
+  };
+  unordered_map<uint32_t, KeyState> busyKeys;
+  uint inflight = 0;
+  
+  mutex completionLock;
+  condition_variable completionCv, drainedCv;
+  deque<pair<Request *, int>> completed;
+  uint64_t outstanding = 0;  // submitted, and the callback not yet returned
+  
+  thread ringThread;
+  vector<thread> completionThreads;
+  
+  void wake() {
+    uint64_t one = 1;
+    write(wakeFd, &one, 8);
+  }
+  
+  bool mapRings(const io_uring_params &p) {
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sqSize = cqSize = max(sqSize, cqSize);
+    
+    auto *sq = (char *) mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return false;
+    auto *cq = single ? sq : (char *) mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) return false;
+    sqes = (io_uring_sqe *) mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    
+    sqHead = (unsigned *) (sq + p.sq_off.head);
+    sqTail = (unsigned *) (sq + p.sq_off.tail);
+    sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *) (sq + p.sq_off.array);
+    cqHead = (unsigned *) (cq + p.cq_off.head);
+    cqTail = (unsigned *) (cq + p.cq_off.tail);
+    cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *) (cq + p.cq_off.cqes);
+    return true;
+  }
+  
+  io_uring_sqe *nextSqe() {
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+  }
+  
+  bool prepare(Request *r) {
+    if (!r->write && r->bufIndex < 0) {
+      lock_guard<mutex> g(bufferLock);
+      if (freeBuffers.empty()) return false;
+      r->bufIndex = freeBuffers.back();
+      freeBuffers.pop_back();
+    }
+    
+    io_uring_sqe *sqe = nextSqe();
+    sqe->fd = fixedFile ? 0 : file;
+    sqe->flags = fixedFile ? IOSQE_FIXED_FILE : 0;
+    sqe->off = r->offset + r->done;
+    sqe->len = r->length - r->done;
+    sqe->user_data = (uint64_t) r;
+    if (r->write) {
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->addr = (uint64_t) (r->data + r->done);
+    } else {
+      sqe->opcode = fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->addr = (uint64_t) (buffers[r->bufIndex] + r->done);
+      sqe->buf_index = r->bufIndex;
+    }
+    inflight++;
+    return true;
+  }
+  
+  void ringLoop() {
+    while (running) {
+      {
+        lock_guard<mutex> g(queueLock);
+        while (!incoming.empty()) {
+          waiting.push_back(incoming.front());
+          incoming.pop_front();
+        }
+      }
+      
+      uint toSubmit = 0;
+      while (!waiting.empty() && inflight < depth - 1) {  // one entry is kept for the wakeup read
+        Request *r = waiting.front();
+        
+        if (!r->ownsKey) {
+          auto it = busyKeys.find(r->key);
+          if (it != busyKeys.end() && (r->write || it->second.writer || !it->second.queued.empty())) {
+            // conflicts with an earlier request on this block that is not done yet. wait behind it
+            it->second.queued.push_back(r);
+            waiting.pop_front();
+            continue;
+          }
+          KeyState &state = busyKeys[r->key];
+          if (r->write) state.writer = true;
+          else state.readers++;
+          r->ownsKey = true;
+        }
+        
+        if (!prepare(r)) break;  // out of read buffers. retried after a completion frees one
+        waiting.pop_front();
+        toSubmit++;
+      }
+      
+      if (!wakeArmed) {  // an eventfd read in the ring itself, so new requests can interrupt the wait
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeFd;
+        sqe->addr = (uint64_t) &wakeValue;
+        sqe->len = 8;
+        sqe->user_data = 0;
+        wakeArmed = true;
+        toSubmit++;
+      }
+      
+      int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+      }
+      
+      reap();
+    }
+  }
+  
+  void reap() {
+    unsigned head = *cqHead;
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      io_uring_cqe &cqe = cqes[head & *cqMask];
+      auto *r = (Request *) cqe.user_data;
+      int res = cqe.res;
+      head++;
+      
+      if (!r) {
+        wakeArmed = false;
+        continue;
+      }
+      inflight--;
+      
+      if (res > 0 && r->done + res < r->length) {  // short: the rest goes first, still owning the block
+        r->done += res;
+        waiting.push_front(r);
+        continue;
+      }
+      if (res >= 0 && r->done + res < r->length) res = -EIO;  // nothing more, e.g. at the end of the file
+      else if (res >= 0) res = r->length;
+      
+      auto it = busyKeys.find(r->key);
+      KeyState &state = it->second;
+      if (r->write) state.writer = false;
+      else state.readers--;
+      if (!state.readers && state.queued.empty()) {
+        busyKeys.erase(it);
+      } else if (!state.readers) {  // hand the block to the next write, or the next reads, ahead of everything else
+        do {
+          Request *next = state.queued.front();
+          state.queued.pop_front();
+          if (next->write) state.writer = true;
+          else state.readers++;
+          next->ownsKey = true;
+          waiting.push_front(next);
+        } while (!state.writer && !state.queued.empty() && !state.queued.front()->write);
+      }
+      
+      {
+        lock_guard<mutex> g(completionLock);
+        completed.emplace_back(r, res);
+      }
+      completionCv.notify_one();
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+  
+  void completionLoop() {
+    while (true) {
+      unique_lock<mutex> g(completionLock);
+      completionCv.wait(g, [this] { return !completed.empty() || !running; });
+      if (completed.empty()) return;
+      
+      auto p = completed.front();
+      completed.pop_front();
+      g.unlock();
+      
+      Request *r = p.first;
+      r->callback(p.second, r->write ? r->data : buffers[r->bufIndex]);
+      
+      if (r->bufIndex >= 0) {
+        {
+          lock_guard<mutex> gb(bufferLock);
+          freeBuffers.push_back(r->bufIndex);
+        }
+        wake();  // the ring thread may be waiting for a buffer
+      }
+      delete r;
+      
+      lock_guard<mutex> gd(completionLock);
+      if (!--outstanding) drainedCv.notify_all();
+    }
+  }
+};
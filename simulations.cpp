@@ -35,6 +35,15 @@ void simulateClient() {
       client.Remove("k" + to_string(i - 3));
     }
   }
+  
+  // a striped object takes ecData + ecParity disks. with fewer, as in the default config, or without -DSMASH_EC, it
+  // is replicated instead
+  client.erasureCoded = true;
+  buffer[0] = 42;
+  client.Insert("e0", buffer.data(), 1001);
+  client.erasureCoded = false;
+  vector<char> tmp = client.Read("e0");
+  if (tmp.size() != 1001 || tmp[0] != 42) debug_break();
 
 //  for (int i = 7; i < 10; ++i) {
 //    client.Remove("k" + to_string(i));
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <random>
+#include "utils/reed_solomon.h"
+#include "utils/free_blocks.h"
+#include "utils/heavy_hitters.h"
+
+using namespace std;
+
+int failures = 0;
+
+void check(bool ok, const string &what) {
+  if (ok) return;
+  failures++;
+  cout << "FAIL " << what << endl;
+}
+
+// every erasure set of up to m shards is rebuilt byte for byte, and m + 1 erasures are refused. the lengths cover
+// the AVX2 body and its scalar tail
+void testReedSolomon() {
+  mt19937 rng(1);
+  for (uint32_t k = 1; k <= 6; ++k) {
+    for (uint32_t m = 1; m <= 4; ++m) {
+      ReedSolomon codec(k, m);
+      for (size_t length: {1, 31, 32, 33, 100}) {
+        vector<vector<uint8_t>> original(k + m, vector<uint8_t>(length));
+        for (uint32_t i = 0; i < k; ++i) {
+          for (auto &b: original[i]) b = rng();
+        }
+        vector<const uint8_t *> data(k);
+        vector<uint8_t *> parity(m);
+        for (uint32_t i = 0; i < k; ++i) data[i] = original[i].data();
+        for (uint32_t p = 0; p < m; ++p) parity[p] = original[k + p].data();
+        codec.encode(data.data(), parity.data(), length);
+        
+        for (uint32_t erased = 1; erased < 1U << (k + m); ++erased) {
+          uint32_t lost = __builtin_popcount(erased);
+          if (lost > m + 1) continue;
+          
+          vector<vector<uint8_t>> shards = original;
+          vector<uint8_t *> pointers(k + m);
+          bool present[16];
+          for (uint32_t i = 0; i < k + m; ++i) {
+            present[i] = !(erased >> i & 1);
+            if (!present[i]) fill(shards[i].begin(), shards[i].end(), 0xa5);
+            pointers[i] = shards[i].data();
+          }
+          
+          string what = "rs k " + to_string(k) + " m " + to_string(m) + " length " + to_string(length) + " erased " +
+                        to_string(erased);
+          bool rebuilt = codec.reconstruct(pointers.data(), present, length);
+          if (lost > m) {
+            check(!rebuilt, what + " rebuilt from too few");
+          } else {
+            check(rebuilt && shards == original, what);
+          }
+        }
+      }
+    }
+  }
+}
+
+// next against a scan of the bitmap, over sizes at the word and summary level boundaries, as blocks are taken and
+// freed at random
+void testFreeBlocks() {
+  mt19937 rng(2);
+  for (uint64_t n: {1, 63, 64, 65, 4096, 4097, 262144 + 5}) {
+    FreeBlocks blocks(n);
+    vector<bool> free(n, false);
+    
+    auto brute = [&](uint64_t from) -> uint64_t {
+      for (uint64_t b = from; b < n; ++b) {
+        if (free[b]) return b;
+      }
+      return -1;
+    };
+    
+    for (int round = 0; round < 200; ++round) {
+      uint64_t changes = round < 100 ? 1 + rng() % 64 : 1;  // many at first, then one at a time near empty and full
+      for (uint64_t c = 0; c < changes; ++c) {
+        uint64_t b = rng() % n;
+        bool f = round < 150 ? rng() % 2 : false;
+        blocks.set(b, f);
+        free[b] = f;
+      }
+      if (round % 20 == 0) {  // a whole word at once
+        uint64_t w = rng() % ((n + 63) / 64);
+        uint64_t bits = round % 40 ? 0 : ~0ULL;
+        if (w * 64 + 64 > n) bits &= (1ULL << (n - w * 64)) - 1;
+        blocks.setWord(w, bits);
+        for (uint64_t b = w * 64; b < min(n, w * 64 + 64); ++b) free[b] = bits >> (b - w * 64) & 1;
+      }
+      
+      for (uint64_t from: {uint64_t(0), n - 1, n, uint64_t(rng() % n), uint64_t(rng() % n)}) {
+        check(blocks.next(from) == brute(from), "free blocks n " + to_string(n) + " round " + to_string(round) +
+                                                " from " + to_string(from));
+      }
+      uint64_t b = rng() % n;
+      check(blocks.isFree(b) == free[b], "free blocks isFree n " + to_string(n) + " block " + to_string(b));
+    }
+  }
+}
+
+// a key counted far more than the rest comes out on top, and its estimate stays within what was added
+void testHeavyHitters() {
+  HeavyHitters counts(16, 32, 1000);
+  mt19937 rng(3);
+  for (int i = 0; i < 100000; ++i) counts.add(i % 10 ? rng() % 100000 : 7);
+  
+  auto top = counts.top(1);
+  check(!top.empty() && top[0].first == 7, "heavy hitters top");
+  uint32_t estimate = counts.estimate(7);
+  check(estimate >= 10000 * 64 && estimate <= 100000 * 64, "heavy hitters estimate " + to_string(estimate));
+}
+
+int main() {
+  testReedSolomon();
+  testFreeBlocks();
+  testHeavyHitters();
+  
+  cout << (failures ? "FAILED " + to_string(failures) : string("OK")) << endl;
+  return failures != 0;
+}
@@ -14,7 +14,7 @@ public:
   
   void push(K const &k) {
     auto h = Heap::push(k);
-    map.insert(make_pair(k, h));
+    map[k] = h;  // replaces the handle of an earlier push that was popped since
   }
   
   void update(K const &k) {
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// the free blocks of a disk, as a bitmap (bit b of word w: block 64w + b is free) under summary levels, each a
+// bitmap of which words of the level below are not zero. all levels are flat arrays. finding the first free block
+// takes a tzcnt per level, two summary levels for up to 2^18 blocks, however full the disk is
+class FreeBlocks {
+public:
+  explicit FreeBlocks(uint64_t nBlocks = 0) : nBlocks(nBlocks) {
+    uint64_t n = nBlocks;
+    do {
+      n = (n + 63) / 64;
+      levels.emplace_back(n, 0);
+    } while (n > 1);
+  }
+  
+  uint64_t size() const { return nBlocks; }
+  
+  bool isFree(uint64_t block) const {
+    return levels[0][block / 64] >> (block % 64) & 1;
+  }
+  
+  void set(uint64_t block, bool free) {
+    uint64_t w = block / 64, bit = 1ULL << (block % 64);
+    setWord(w, free ? levels[0][w] | bit : levels[0][w] & ~bit);
+  }
+  
+  // 64 blocks at once, from block 64w
+  uint64_t word(uint64_t w) const { return levels[0][w]; }
+  
+  void setWord(uint64_t w, uint64_t bits) {
+    for (size_t l = 0; l < levels.size(); ++l) {
+      bool wasEmpty = !levels[l][w];
+      levels[l][w] = bits;
+      if (wasEmpty == !bits || l + 1 == levels.size()) return;  // the summary bit above stays
+      
+      uint64_t bit = 1ULL << (w % 64);
+      w /= 64;
+      bits = bits ? levels[l + 1][w] | bit : levels[l + 1][w] & ~bit;
+    }
+  }
+  
+  // the first free block at or after from, -1 if none
+  uint64_t next(uint64_t from) const {
+    uint64_t pos = from;
+    size_t l = 0;
+    for (; l < levels.size(); ++l) {  // up, while the rest of the word is empty
+      uint64_t w = pos / 64;
+      if (w >= levels[l].size()) return -1;
+      
+      uint64_t bits = levels[l][w] & (~0ULL << (pos % 64));
+      if (bits) {
+        pos = w * 64 + __builtin_ctzll(bits);
+        break;
+      }
+      pos = w + 1;
+    }
+    if (l == levels.size()) return -1;
+    
+    for (; l > 0; --l) pos = pos * 64 + __builtin_ctzll(levels[l - 1][pos]);  // down, to the first set bit
+    return pos;
+  }
+
+private:
+  uint64_t nBlocks;
+  std::vector<std::vector<uint64_t>> levels;  // [0]: the blocks, then the summaries up to a single word
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <vector>
+
+// approximate access counts of the hottest keys (space-saving), with exponential decay. the table is split into
+// shards of a few slots each, and a key is counted in the shard its hash picks, so counting threads meet only on
+// the same shard, and no lock: a slot is one atomic word (key << 32 | count) updated by CAS. counts are fixed point
+// (6 fraction bits) and decay by `decay` every `period` seconds. estimate scans the key's shard, width slots, and
+// top all shards x width
+class HeavyHitters {
+public:
+  HeavyHitters(uint32_t shards = 16, uint32_t width = 32, uint32_t period = 8, double decay = 0.9)
+      : shards(shards), width(width), period(period), decay(decay), slots(shards * width), lastDecay(time(0)) {}
+  
+  void add(uint32_t key, uint32_t times = 1) {
+    age();
+    uint64_t inc = 64ULL * times;
+    std::atomic<uint64_t> *shard = &slots[shardOf(key) * width];
+    
+    for (int attempt = 0; attempt < 4; ++attempt) {
+      std::atomic<uint64_t> *coldest = nullptr;
+      uint64_t coldestWord = 0;
+      for (uint32_t i = 0; i < width; ++i) {
+        uint64_t word = shard[i].load(std::memory_order_relaxed);
+        if (count(word) && keyOf(word) == key) {
+          while (!shard[i].compare_exchange_weak(word, pack(key, count(word) + inc), std::memory_order_relaxed)) {
+            if (!count(word) || keyOf(word) != key) break;  // decayed out or taken over. start over
+          }
+          if (count(word) && keyOf(word) == key) return;
+          coldest = nullptr;
+          break;
+        }
+        if (!coldest || count(word) < count(coldestWord)) {
+          coldest = &shard[i];
+          coldestWord = word;
+        }
+      }
+      // a new key takes over the coldest slot, and inherits its count as the error bound
+      if (coldest && coldest->compare_exchange_strong(coldestWord, pack(key, count(coldestWord) + inc),
+                                                      std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+  
+  uint32_t estimate(uint32_t key) {
+    age();
+    const std::atomic<uint64_t> *shard = &slots[shardOf(key) * width];
+    for (uint32_t i = 0; i < width; ++i) {
+      uint64_t word = shard[i].load(std::memory_order_relaxed);
+      if (count(word) && keyOf(word) == key) return count(word);
+    }
+    return 0;
+  }
+  
+  // up to n (key, count), hottest first
+  std::vector<std::pair<uint32_t, uint32_t>> top(size_t n) {
+    age();
+    std::vector<std::pair<uint32_t, uint32_t>> all;
+    all.reserve(slots.size());
+    for (auto &slot: slots) {
+      uint64_t word = slot.load(std::memory_order_relaxed);
+      if (count(word)) all.emplace_back(keyOf(word), count(word));
+    }
+    
+    n = std::min(n, all.size());
+    std::partial_sort(all.begin(), all.begin() + n, all.end(),
+                      [](auto &a, auto &b) { return a.second > b.second; });
+    all.resize(n);
+    return all;
+  }
+
+private:
+  const uint32_t shards, width, period;
+  const double decay;
+  std::vector<std::atomic<uint64_t>> slots;  // shards x width
+  std::atomic<time_t> lastDecay;
+  
+  static uint32_t keyOf(uint64_t word) { return word >> 32; }
+  
+  static uint32_t count(uint64_t word) { return (uint32_t) word; }
+  
+  static uint64_t pack(uint32_t key, uint64_t count) {
+    return (uint64_t) key << 32 | std::min(count, (uint64_t) UINT32_MAX);
+  }
+  
+  // fibonacci hashing, as block ids are often consecutive
+  uint32_t shardOf(uint32_t key) const {
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) % shards;
+  }
+  
+  // the thread that moves lastDecay forward scales every slot. adds racing with it may be scaled or not
+  void age() {
+    time_t now = time(0), last = lastDecay.load(std::memory_order_relaxed);
+    if (now - last < period || !lastDecay.compare_exchange_strong(last, now)) return;
+    
+    double factor = pow(decay, (now - last) / (double) period);
+    for (auto &slot: slots) {
+      uint64_t word = slot.load(std::memory_order_relaxed);
+      while (count(word) &&
+             !slot.compare_exchange_weak(word, pack(keyOf(word), (uint64_t) (count(word) * factor)),
+                                         std::memory_order_relaxed)) {}
+    }
+  }
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Reed-Solomon erasure code over GF(2^8) (polynomial 0x11d): k data shards and m parity shards of the same length,
+// any k of which rebuild all the others. the code is systematic, and the parity rows of the generator form a Cauchy
+// matrix, so every k x k submatrix of it is invertible. a shard times a constant is added with the split-nibble
+// lookup tables, 32 bytes per PSHUFB pair with AVX2
+class ReedSolomon {
+public:
+  const uint32_t k, m;
+  
+  ReedSolomon(uint32_t k, uint32_t m) : k(k), m(m), generator((k + m) * k, 0) {
+    for (uint32_t i = 0; i < k; ++i) generator[i * k + i] = 1;
+    for (uint32_t p = 0; p < m; ++p) {
+      for (uint32_t j = 0; j < k; ++j) generator[(k + p) * k + j] = inverse((k + p) ^ j);
+    }
+  }
+  
+  // parity[p] = sum of generator[k + p][j] * data[j]
+  void encode(const uint8_t *const *data, uint8_t *const *parity, size_t length) const {
+    for (uint32_t p = 0; p < m; ++p) {
+      memset(parity[p], 0, length);
+      for (uint32_t j = 0; j < k; ++j) mulAdd(parity[p], data[j], generator[(k + p) * k + j], length);
+    }
+  }
+  
+  // shards: k + m buffers of length bytes, the missing ones (present[i] false) are written. false if fewer than k
+  // are present
+  bool reconstruct(uint8_t *const *shards, const bool *present, size_t length) const {
+    std::vector<uint32_t> rows;
+    for (uint32_t i = 0; i < k + m && rows.size() < k; ++i) {
+      if (present[i]) rows.push_back(i);
+    }
+    if (rows.size() < k) return false;
+    
+    // the data shards are decoding * (the shards of rows)
+    std::vector<uint8_t> decoding(k * k);
+    for (uint32_t r = 0; r < k; ++r) memcpy(&decoding[r * k], &generator[rows[r] * k], k);
+    invert(decoding);
+    
+    for (uint32_t i = 0; i < k; ++i) {
+      if (present[i]) continue;
+      memset(shards[i], 0, length);
+      for (uint32_t r = 0; r < k; ++r) mulAdd(shards[i], shards[rows[r]], decoding[i * k + r], length);
+    }
+    
+    for (uint32_t p = 0; p < m; ++p) {
+      if (present[k + p]) continue;
+      memset(shards[k + p], 0, length);
+      for (uint32_t j = 0; j < k; ++j) mulAdd(shards[k + p], shards[j], generator[(k + p) * k + j], length);
+    }
+    return true;
+  }
+  
+  // dst ^= c * src
+  static void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+    if (c == 0) return;
+    
+    size_t i = 0;
+    if (c == 1) {
+      for (; i + 8 <= length; i += 8) {
+        uint64_t d, s;
+        memcpy(&d, dst + i, 8);
+        memcpy(&s, src + i, 8);
+        d ^= s;
+        memcpy(dst + i, &d, 8);
+      }
+      for (; i < length; ++i) dst[i] ^= src[i];
+      return;
+    }
+    
+    const Tables &t = tables();
+#ifdef __AVX2__
+    alignas(16) uint8_t low[16], high[16];  // c times each low nibble, and each high nibble
+    for (int n = 0; n < 16; ++n) {
+      low[n] = mul(c, n);
+      high[n] = mul(c, n << 4);
+    }
+    const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) low));
+    const __m256i highTable = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) high));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    for (; i + 32 <= length; i += 32) {
+      __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+      __m256i lo = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(s, mask));
+      __m256i hi = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+      __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+      _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, _mm256_xor_si256(lo, hi)));
+    }
+#endif
+    const uint8_t *row = &t.product[c * 256];
+    for (; i < length; ++i) dst[i] ^= row[src[i]];
+  }
+  
+  static uint8_t mul(uint8_t a, uint8_t b) {
+    return tables().product[a * 256 + b];
+  }
+  
+  static uint8_t inverse(uint8_t a) {
+    const Tables &t = tables();
+    return t.exp[255 - t.log[a]];
+  }
+
+private:
+  std::vector<uint8_t> generator;  // (k + m) x k, row-major
+  
+  struct Tables {
+    uint8_t exp[512], log[256];
+    std::vector<uint8_t> product;  // 256 x 256
+    
+    Tables() : product(256 * 256, 0) {
+      uint32_t x = 1;
+      for (int i = 0; i < 255; ++i) {
+        exp[i] = exp[i + 255] = x;
+        log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+      }
+      log[0] = 0;
+      exp[510] = exp[511] = 0;
+      
+      for (int a = 1; a < 256; ++a) {
+        for (int b = 1; b < 256; ++b) product[a * 256 + b] = exp[log[a] + log[b]];
+      }
+    }
+  };
+  
+  static const Tables &tables() {
+    static const Tables t;
+    return t;
+  }
+  
+  // Gauss-Jordan over GF(2^8). the matrix is invertible by construction
+  void invert(std::vector<uint8_t> &a) const {
+    std::vector<uint8_t> b(k * k, 0);
+    for (uint32_t i = 0; i < k; ++i) b[i * k + i] = 1;
+    
+    for (uint32_t col = 0; col < k; ++col) {
+      uint32_t pivot = col;
+      while (a[pivot * k + col] == 0) ++pivot;
+      if (pivot != col) {
+        for (uint32_t j = 0; j < k; ++j) {
+          std::swap(a[pivot * k + j], a[col * k + j]);
+          std::swap(b[pivot * k + j], b[col * k + j]);
+        }
+      }
+      
+      uint8_t scale = inverse(a[col * k + col]);
+      for (uint32_t j = 0; j < k; ++j) {
+        a[col * k + j] = mul(a[col * k + j], scale);
+        b[col * k + j] = mul(b[col * k + j], scale);
+      }
+      
+      for (uint32_t r = 0; r < k; ++r) {
+        uint8_t factor = a[r * k + col];
+        if (r == col || factor == 0) continue;
+        for (uint32_t j = 0; j < k; ++j) {
+          a[r * k + j] ^= mul(factor, a[col * k + j]);
+          b[r * k + j] ^= mul(factor, b[col * k + j]);
+        }
+      }
+    }
+    a = b;
+  }
+};